@@ -1,130 +1,796 @@
 #include "connmgr.h"
 
 #include "config.h"
+#include "connmgr_uring.h"
+#include "lib/slotmap.h"
 #include "lib/tcpsock.h"
-#include "lib/vector.h"
+#include "lib/timer_wheel.h"
 #include "sbuffer.h"
+#include "sensor_protocol.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/poll.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <wait.h>
 
-void connmgr_listen(int port_number, sbuffer_t* buffer) {
+// how often the paused connmgr checks whether it can read again
+#define PAUSED_POLL_MS 100
 
+// max number of ready sockets handled per wakeup
+#ifndef CONNMGR_MAX_EVENTS
+    #define CONNMGR_MAX_EVENTS 256
+#endif
+
+// bytes received per connection in one go, room for a bit over 100 readings
+#ifndef CONNMGR_RECEIVE_BUFFER
+    #define CONNMGR_RECEIVE_BUFFER 2048
+#endif
+
+// pending connections per listening socket, the kernel caps it at net.core.somaxconn
+#ifndef CONNMGR_BACKLOG
+    #define CONNMGR_BACKLOG 4096
+#endif
+
+// provided receive buffers per io_uring loop, each one CONNMGR_RECEIVE_BUFFER bytes
+#ifndef CONNMGR_URING_BUFFERS
+    #define CONNMGR_URING_BUFFERS 256
+#endif
+
+// datagrams received per recvmmsg call, each one up to CONNMGR_RECEIVE_BUFFER bytes
+#ifndef CONNMGR_UDP_BATCH
+    #define CONNMGR_UDP_BATCH 64
+#endif
+
+_Static_assert(CONNMGR_RECEIVE_BUFFER >= SENSOR_RECORD_SIZE, "CONNMGR_RECEIVE_BUFFER must fit a reading");
+_Static_assert(CONNMGR_RECEIVE_BUFFER >= SENSOR_FRAME_HEADER_SIZE, "CONNMGR_RECEIVE_BUFFER must fit a frame header");
+
+// set while the shared buffer is above its high watermark
+static atomic_bool readingPaused = false;
+
+void connmgr_buffer_watermark(void* arg, bool high) {
+    (void) arg;
+    atomic_store(&readingPaused, high);
+}
+
+// A sensor connection. Readings are received in bulk, a reading (or frame header) that didn't arrive completely
+// stays at the start of 'received' until the rest of it does.
+typedef struct {
+    tcpsock_t* socket;
+    slotmap_handle_t handle; // in the connections of its loop
+    timer_wheel_timer_t timeout; // due once the sensor may have been silent for TIMEOUT
+    bool receiving; // io_uring: a multishot receive still refers to this connection
+    bool closing;   // io_uring: closed, waiting for the receive to finish
+    int protocol;   // version of the sensor protocol, 0 until the first bytes arrived
+    sensor_frame_count_t frameRecords; // version 2: records of the current frame still to come
+    sensor_id_t frameSensor;
+    sensor_ts_t frameTs;               // version 2: timestamp of the last record
+    size_t size;    // number of bytes in 'received'
+    unsigned char received[CONNMGR_RECEIVE_BUFFER];
+} connection_t;
+
+// What the UDP listener knows about a sensor: without a connection, the sensor id is all there is.
+typedef struct {
+    bool announced;
+    bool framed;                     // a version 2 frame came in, 'sequence' is set
+    sensor_frame_sequence_t sequence; // of the last version 2 frame
+    sensor_data_t last;              // last version 1 reading
+} udp_sensor_t;
+
+// Receives the datagrams of all the sensors that don't hold a connection.
+typedef struct {
+    int fd;
+    udp_sensor_t* sensors; // indexed by sensor id
+    size_t readings;
+    size_t duplicates; // readings dropped because they came in already
+    size_t lost;       // frames that never came in
+    size_t invalid;    // datagrams that were too long or didn't follow the protocol
+    struct mmsghdr messages[CONNMGR_UDP_BATCH];
+    struct iovec vectors[CONNMGR_UDP_BATCH];
+    unsigned char datagrams[CONNMGR_UDP_BATCH][CONNMGR_RECEIVE_BUFFER];
+} udp_listener_t;
+
+// State shared by all event loops
+typedef struct {
+    sbuffer_t* buffer;
+    int debugFd;
+    int stop;                   // eventfd, readable once the connmgr stops
+    atomic_bool stopping;
+    _Atomic time_t lastReading; // last time any loop got an event
+    atomic_int nrOfSensorValues;
+} connmgr_t;
+
+// One event loop, with its own listening socket and the connections accepted on it.
+// With epoll, every socket is registered once: the listening socket in 'events', the sensor connections
+// in 'sensors', which is itself in 'events' unless reading is paused. A sensor connection is registered with its handle,
+// the UDP socket with SLOTMAP_NO_HANDLE.
+// With io_uring, the listening socket and every connection have a multishot request armed in 'uring', the UDP socket a poll.
+typedef struct {
+    connmgr_t* connmgr;
+    pthread_t thread;
+    tcpsock_t* listener;
+    slotmap_t* connections;
+    udp_listener_t* udp;    // only the first loop may have one
+    connmgr_uring_t* uring; // NULL with epoll
+    int events;
+    int sensors;
+    bool watchingSensors;
+    time_t resumed; // sensors can't be blamed for being silent while we weren't reading
+    timer_wheel_t* timeouts;
+} connmgr_loop_t;
+
+// A reading doesn't touch the wheel: the timeout only looks at the last reading once it's due.
+static void arm_timeout(connmgr_loop_t* loop, connection_t* connection, time_t lastSeen) {
+    timer_wheel_add(loop->timeouts, &connection->timeout, lastSeen + TIMEOUT + 1);
+}
+
+static connection_t* add_sensor(connmgr_loop_t* loop, tcpsock_t* socket) {
+    connection_t* connection = malloc(sizeof(*connection));
+    assert(connection != NULL);
+    connection->socket = socket;
+    connection->receiving = loop->uring != NULL;
+    connection->closing = false;
+    connection->protocol = 0;
+    connection->frameRecords = 0;
+    connection->size = 0;
+    connection->handle = slotmap_insert(loop->connections, connection);
+    connection->timeout.next = NULL;
+    arm_timeout(loop, connection, *tcp_last_seen(socket));
+    if (loop->uring != NULL) {
+        connmgr_uring_recv(loop->uring, socket->sd, connection);
+    } else {
+        struct epoll_event event = {.events = EPOLLIN, .data.u64 = connection->handle};
+        ASSERT_ELSE_PERROR(epoll_ctl(loop->sensors, EPOLL_CTL_ADD, socket->sd, &event) == 0);
+    }
+    return connection;
+}
+
+// Closes the sensor connection and unregisters it.
+static void close_sensor(connmgr_loop_t* loop, connection_t* connection) {
+    timer_wheel_remove(loop->timeouts, &connection->timeout);
+    if (connection->receiving) {
+        // the kernel may still complete the receive, the connection goes once it reports it's done
+        if (!connection->closing)
+            connmgr_uring_cancel(loop->uring, connection);
+        connection->closing = true;
+        return;
+    }
+    // tcp_close doesn't always close the descriptor, so don't leave it in the epoll set
+    if (loop->uring == NULL)
+        ASSERT_ELSE_PERROR(epoll_ctl(loop->sensors, EPOLL_CTL_DEL, connection->socket->sd, NULL) == 0);
+    tcp_close(&connection->socket);
+    slotmap_remove(loop->connections, connection->handle);
+    free(connection);
+}
+
+// Readings decoded straight into reserved buffer slots, and inserted together by batch_commit.
+typedef struct {
+    sensor_data_t* slots;
+    size_t reserved;
+    size_t used;
+    size_t expected;     // at most how many readings are still to come, to size the next reservation
+    sensor_data_t spare; // for a reading that didn't get a slot because the buffer is full
+} reading_batch_t;
+
+static void batch_init(reading_batch_t* batch, size_t bytes) {
+    batch->reserved = batch->used = 0;
+    batch->expected = bytes / SENSOR_FRAME_RECORD_SIZE;
+}
+
+// Inserts the readings of the batch in the buffer, all at once.
+static void batch_commit(connmgr_t* connmgr, reading_batch_t* batch) {
+    if (batch->reserved == 0)
+        return;
+    // SBUFFER_FULL means the buffer rejected (and counted) readings,
+    // SBUFFER_FAILURE that they couldn't be written to the write-ahead log
+    if (sbuffer_commit(connmgr->buffer, batch->used) == SBUFFER_FAILURE)
+        printf("Readings lost: the buffer couldn't accept them\n");
+    batch->reserved = batch->used = 0;
+}
+
+// Returns where to decode the next reading, which batch_add then inserts.
+static sensor_data_t* batch_slot(connmgr_t* connmgr, reading_batch_t* batch) {
+    if (batch->used == batch->reserved) {
+        batch_commit(connmgr, batch);
+        batch->reserved = sbuffer_reserve(connmgr->buffer, batch->expected > 0 ? batch->expected : 1, &batch->slots);
+    }
+    return batch->used < batch->reserved ? &batch->slots[batch->used] : &batch->spare;
+}
+
+// Inserts the reading decoded in 'data', the last slot batch_slot returned, in the buffer.
+// 'announced' tells whether its sensor was seen before.
+static void handle_reading(connmgr_t* connmgr, reading_batch_t* batch, bool* announced, const sensor_data_t* data) {
+    if (!*announced) {
+        printf("A new sensor with id = %" PRIu16 " has opened a new connection\n", data->id);
+        *announced = true;
+    }
 #if DEBUG
-    const int fd =
-        open("sensor_data_recv", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
-    assert(fd > 0);
+    // one write per reading, so the loops don't interleave their fields, always in the version 1 format
+    unsigned char record[SENSOR_RECORD_SIZE];
+    memcpy(record, &data->id, sizeof(data->id));
+    memcpy(record + sizeof(data->id), &data->value, sizeof(data->value));
+    memcpy(record + sizeof(data->id) + sizeof(data->value), &data->ts, sizeof(data->ts));
+    ASSERT_ELSE_PERROR(write(connmgr->debugFd, record, SENSOR_RECORD_SIZE) == SENSOR_RECORD_SIZE);
 #endif
+    int nrOfSensorValues = atomic_fetch_add_explicit(&connmgr->nrOfSensorValues, 1, memory_order_relaxed) + 1;
+    printf("sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld  [%d]\n", data->id, data->value, data->ts, nrOfSensorValues);
+
+    if (batch->expected > 0)
+        batch->expected--;
+    if (data != &batch->spare) {
+        batch->used++;
+        return;
+    }
+    // the buffer applies its overflow policy, or spills
+    if (sbuffer_insert_first(connmgr->buffer, data) == SBUFFER_FAILURE)
+        printf("Reading of sensor %" PRIu16 " lost: the buffer couldn't accept it\n", data->id);
+}
+
+// ------------------------------ WIRE FORMAT ------------------------------------
+// see sensor_protocol.h, the sensors send the fields one after the other, without padding
+
+typedef struct {
+    sensor_id_t marker;
+    uint8_t version;
+    sensor_frame_sequence_t sequence;
+    sensor_id_t sensor;
+    sensor_frame_count_t count;
+    sensor_ts_t ts;
+} frame_header_t;
+
+static void decode_reading(const unsigned char* bytes, sensor_data_t* data) {
+    memcpy(&data->id, bytes, sizeof(data->id));
+    memcpy(&data->value, bytes + sizeof(data->id), sizeof(data->value));
+    memcpy(&data->ts, bytes + sizeof(data->id) + sizeof(data->value), sizeof(data->ts));
+}
+
+// Returns false if the header isn't one of a version 2 frame.
+static bool decode_frame_header(const unsigned char* bytes, frame_header_t* header) {
+    memcpy(&header->marker, bytes, sizeof(header->marker));
+    bytes += sizeof(header->marker);
+    header->version = *bytes++;
+    memcpy(&header->sequence, bytes, sizeof(header->sequence));
+    bytes += sizeof(header->sequence);
+    memcpy(&header->sensor, bytes, sizeof(header->sensor));
+    bytes += sizeof(header->sensor);
+    memcpy(&header->count, bytes, sizeof(header->count));
+    bytes += sizeof(header->count);
+    memcpy(&header->ts, bytes, sizeof(header->ts));
+    return header->marker == SENSOR_PROTOCOL_MARKER && header->version == SENSOR_PROTOCOL_VERSION;
+}
+
+// Decodes a frame record that follows the one with timestamp 'ts', into 'value' and 'ts'.
+static void decode_frame_record(const unsigned char* bytes, sensor_value_t* value, sensor_ts_t* ts) {
+    sensor_ts_delta_t delta;
+    memcpy(value, bytes, sizeof(*value));
+    memcpy(&delta, bytes + sizeof(*value), sizeof(delta));
+    *ts += delta;
+}
+
+// Handles the reading, or version 2 frame header, at the start of the 'size' bytes in 'bytes'.
+// Returns the number of bytes used, 0 if more bytes are needed, or -1 if the sensor broke the protocol.
+static ssize_t parse_next(connmgr_t* connmgr, reading_batch_t* batch, connection_t* connection, const unsigned char* bytes, size_t size) {
+    if (connection->protocol == 0) {
+        if (size < sizeof(sensor_id_t))
+            return 0;
+        sensor_id_t id;
+        memcpy(&id, bytes, sizeof(id));
+        connection->protocol = id == SENSOR_PROTOCOL_MARKER ? SENSOR_PROTOCOL_VERSION : 1;
+    }
+
+    if (connection->protocol == 1) {
+        if (size < SENSOR_RECORD_SIZE)
+            return 0;
+        sensor_data_t* data = batch_slot(connmgr, batch);
+        decode_reading(bytes, data);
+        *tcp_last_seen_sensor_id(connection->socket) = data->id;
+        handle_reading(connmgr, batch, &connection->socket->announced, data);
+        return SENSOR_RECORD_SIZE;
+    }
+
+    if (connection->frameRecords == 0) {
+        if (size < SENSOR_FRAME_HEADER_SIZE)
+            return 0;
+        frame_header_t header;
+        if (!decode_frame_header(bytes, &header)) {
+            printf("Sensor with id %d sent a frame of unknown version %u\n", *tcp_last_seen_sensor_id(connection->socket), header.version);
+            return -1;
+        }
+        connection->frameSensor = header.sensor;
+        connection->frameRecords = header.count;
+        connection->frameTs = header.ts;
+        return SENSOR_FRAME_HEADER_SIZE;
+    }
+
+    if (size < SENSOR_FRAME_RECORD_SIZE)
+        return 0;
+    sensor_data_t* data = batch_slot(connmgr, batch);
+    decode_frame_record(bytes, &data->value, &connection->frameTs);
+    connection->frameRecords--;
+    data->id = connection->frameSensor;
+    data->ts = connection->frameTs;
+    *tcp_last_seen_sensor_id(connection->socket) = data->id;
+    handle_reading(connmgr, batch, &connection->socket->announced, data);
+    return SENSOR_FRAME_RECORD_SIZE;
+}
+
+// Handles every complete reading in 'connection->received', and keeps the rest.
+// The readings are decoded into the buffer and inserted with one commit.
+// Returns false if the sensor broke the protocol.
+static bool parse_readings(connmgr_t* connmgr, connection_t* connection) {
+    size_t parsed = 0;
+    ssize_t used;
+    reading_batch_t batch;
+    batch_init(&batch, connection->size);
+    while ((used = parse_next(connmgr, &batch, connection, connection->received + parsed, connection->size - parsed)) > 0)
+        parsed += used;
+    batch_commit(connmgr, &batch);
+    connection->size -= parsed;
+    memmove(connection->received, connection->received + parsed, connection->size);
+    return used == 0;
+}
+
+// Receives whatever 'connection' has available in one call, and inserts every complete reading in the buffer.
+// Returns false if the sensor disconnected or broke the protocol.
+static bool receive_readings(connmgr_t* connmgr, connection_t* connection) {
+    int bytes = sizeof(connection->received) - connection->size;
+    const int result = tcp_receive(connection->socket, connection->received + connection->size, &bytes);
+    if (result != TCP_NO_ERROR) {
+        // a failed socket stays readable, so it's dropped like a closed one
+        printf("Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(connection->socket));
+        return false;
+    }
+    connection->size += bytes;
+    return parse_readings(connmgr, connection);
+}
+
+// Parses 'size' bytes the kernel received for 'connection' elsewhere.
+// Returns false if the sensor broke the protocol.
+static bool consume_readings(connmgr_t* connmgr, connection_t* connection, const unsigned char* data, size_t size) {
+    while (size > 0) {
+        size_t room = sizeof(connection->received) - connection->size;
+        size_t n = size < room ? size : room;
+        memcpy(connection->received + connection->size, data, n);
+        connection->size += n;
+        if (!parse_readings(connmgr, connection))
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+// ------------------------------ UDP LISTENER -----------------------------------
+
+static udp_listener_t* udp_open(int port_number) {
+    udp_listener_t* udp = malloc(sizeof(*udp));
+    assert(udp != NULL);
+    udp->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ASSERT_ELSE_PERROR(udp->fd >= 0);
+    // a large fleet sends in bursts, the kernel only keeps what fits in the receive buffer
+    int size = 4 << 20;
+    setsockopt(udp->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port_number), .sin_addr.s_addr = htonl(INADDR_ANY)};
+    if (bind(udp->fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        perror("bind failed");
+        exit(EXIT_FAILURE);
+    }
+    udp->sensors = calloc((size_t) UINT16_MAX + 1, sizeof(*udp->sensors));
+    assert(udp->sensors != NULL);
+    udp->readings = udp->duplicates = udp->lost = udp->invalid = 0;
+    for (int i = 0; i < CONNMGR_UDP_BATCH; i++) {
+        udp->vectors[i] = (struct iovec){.iov_base = udp->datagrams[i], .iov_len = sizeof(udp->datagrams[i])};
+        udp->messages[i].msg_hdr = (struct msghdr){.msg_iov = &udp->vectors[i], .msg_iovlen = 1};
+    }
+    return udp;
+}
+
+static void udp_close(udp_listener_t* udp) {
+    printf("UDP listener got %zu readings, dropped %zu duplicates and %zu invalid datagrams, %zu frames were lost\n",
+           udp->readings, udp->duplicates, udp->invalid, udp->lost);
+    close(udp->fd);
+    free(udp->sensors);
+    free(udp);
+}
 
-    vector_t* sockets = vector_create();
+// Handles the version 2 frames in a datagram, returns false if they don't fill it exactly.
+static bool handle_frames(connmgr_t* connmgr, reading_batch_t* batch, udp_listener_t* udp, const unsigned char* bytes, size_t size) {
+    while (size > 0) {
+        frame_header_t header;
+        if (size < SENSOR_FRAME_HEADER_SIZE || !decode_frame_header(bytes, &header)
+            || size - SENSOR_FRAME_HEADER_SIZE < (size_t) header.count * SENSOR_FRAME_RECORD_SIZE)
+            return false;
+        bytes += SENSOR_FRAME_HEADER_SIZE;
+        size -= SENSOR_FRAME_HEADER_SIZE + (size_t) header.count * SENSOR_FRAME_RECORD_SIZE;
 
-    {
-        tcpsock_t* connection_socket = NULL;
-        if (tcp_passive_open(&connection_socket, port_number) != TCP_NO_ERROR)
-            exit(EXIT_FAILURE);
-        vector_add(sockets, connection_socket);
+        // a frame that isn't ahead of the last one (within half the sequence numbers) came in already
+        udp_sensor_t* sensor = &udp->sensors[header.sensor];
+        const sensor_frame_sequence_t ahead = header.sequence - sensor->sequence;
+        if (sensor->framed && (ahead == 0 || ahead > 128)) {
+            udp->duplicates += header.count;
+            bytes += (size_t) header.count * SENSOR_FRAME_RECORD_SIZE;
+            continue;
+        }
+        if (sensor->framed)
+            udp->lost += ahead - 1;
+        sensor->framed = true;
+        sensor->sequence = header.sequence;
+
+        sensor_ts_t ts = header.ts;
+        for (size_t i = 0; i < header.count; i++, bytes += SENSOR_FRAME_RECORD_SIZE) {
+            sensor_data_t* data = batch_slot(connmgr, batch);
+            decode_frame_record(bytes, &data->value, &ts);
+            data->id = header.sensor;
+            data->ts = ts;
+            handle_reading(connmgr, batch, &sensor->announced, data);
+            udp->readings++;
+        }
     }
+    return true;
+}
+
+// Handles the version 1 readings in a datagram, returns false if they don't fill it exactly.
+// Without sequence numbers, only a reading that came in twice in a row is known to be a duplicate.
+static bool handle_datagram_readings(connmgr_t* connmgr, reading_batch_t* batch, udp_listener_t* udp, const unsigned char* bytes, size_t size) {
+    if (size % SENSOR_RECORD_SIZE != 0)
+        return false;
+    for (; size > 0; bytes += SENSOR_RECORD_SIZE, size -= SENSOR_RECORD_SIZE) {
+        // a duplicate is decoded in the slot all the same, the next reading takes it
+        sensor_data_t* data = batch_slot(connmgr, batch);
+        decode_reading(bytes, data);
+        udp_sensor_t* sensor = &udp->sensors[data->id];
+        if (sensor->announced && sensor->last.ts == data->ts && sensor->last.value == data->value) {
+            udp->duplicates++;
+            continue;
+        }
+        sensor->last = *data;
+        handle_reading(connmgr, batch, &sensor->announced, data);
+        udp->readings++;
+    }
+    return true;
+}
+
+// Receives a batch of datagrams in one call, and inserts their readings in the buffer with one commit.
+// Only one batch per wakeup, so the sensor connections get their turn.
+static void receive_datagrams(connmgr_t* connmgr, udp_listener_t* udp) {
+    int n = recvmmsg(udp->fd, udp->messages, CONNMGR_UDP_BATCH, MSG_DONTWAIT, NULL);
+    ASSERT_ELSE_PERROR(n >= 0 || errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    size_t received = 0;
+    for (int i = 0; i < n; i++)
+        received += udp->messages[i].msg_len;
+    reading_batch_t batch;
+    batch_init(&batch, received);
+    for (int i = 0; i < n; i++) {
+        const unsigned char* bytes = udp->datagrams[i];
+        const size_t size = udp->messages[i].msg_len;
+        sensor_id_t marker = 0;
+        if (size >= sizeof(marker))
+            memcpy(&marker, bytes, sizeof(marker));
+        bool valid = (udp->messages[i].msg_hdr.msg_flags & MSG_TRUNC) == 0 && size > 0;
+        if (valid)
+            valid = marker == SENSOR_PROTOCOL_MARKER ? handle_frames(connmgr, &batch, udp, bytes, size)
+                                                     : handle_datagram_readings(connmgr, &batch, udp, bytes, size);
+        if (!valid)
+            udp->invalid++;
+    }
+    batch_commit(connmgr, &batch);
+}
+
+// ------------------------------ EVENT LOOPS ------------------------------------
+
+static void loop_init(connmgr_loop_t* loop, connmgr_t* connmgr, const connmgr_config_t* config, bool shared, connmgr_uring_t* uring, int udp_port) {
+    loop->connmgr = connmgr;
+    loop->listener = NULL;
+    // epoll drains the backlog on every wakeup, io_uring's multishot accept waits for connections itself
+    tcp_listen_config_t listen = {
+        .backlog = config->backlog > 0 ? config->backlog : CONNMGR_BACKLOG,
+        .shared = shared,
+        .nonblocking = uring == NULL,
+    };
+    int result = tcp_passive_open_config(&loop->listener, config->port, &listen);
+    if (result != TCP_NO_ERROR)
+        exit(EXIT_FAILURE);
+    loop->connections = slotmap_create();
+    loop->udp = udp_port > 0 ? udp_open(udp_port) : NULL;
+    loop->uring = uring;
+    loop->events = loop->sensors = -1;
+    if (uring != NULL) {
+        connmgr_uring_accept(uring, loop->listener->sd, loop->listener);
+        connmgr_uring_poll(uring, connmgr->stop, &connmgr->stop);
+        if (loop->udp != NULL)
+            connmgr_uring_poll(uring, loop->udp->fd, loop->udp);
+    } else {
+        loop->events = epoll_create1(EPOLL_CLOEXEC);
+        loop->sensors = epoll_create1(EPOLL_CLOEXEC);
+        ASSERT_ELSE_PERROR(loop->events >= 0 && loop->sensors >= 0);
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = loop->listener};
+        ASSERT_ELSE_PERROR(epoll_ctl(loop->events, EPOLL_CTL_ADD, loop->listener->sd, &event) == 0);
+        event = (struct epoll_event){.events = EPOLLIN, .data.ptr = connmgr};
+        ASSERT_ELSE_PERROR(epoll_ctl(loop->events, EPOLL_CTL_ADD, connmgr->stop, &event) == 0);
+        // like the sensor connections, the datagrams stay in the socket while reading is paused
+        event = (struct epoll_event){.events = EPOLLIN, .data.u64 = SLOTMAP_NO_HANDLE};
+        if (loop->udp != NULL)
+            ASSERT_ELSE_PERROR(epoll_ctl(loop->sensors, EPOLL_CTL_ADD, loop->udp->fd, &event) == 0);
+    }
+    loop->watchingSensors = false;
+    loop->resumed = time(NULL);
+    loop->timeouts = timer_wheel_create(TIMEOUT + 1, loop->resumed);
+}
+
+static void loop_free(connmgr_loop_t* loop) {
+    while (slotmap_size(loop->connections) > 0) {
+        connection_t* connection = slotmap_at(loop->connections, slotmap_size(loop->connections) - 1);
+        // nothing is reaped anymore, and closing the ring cancels what's left
+        connection->receiving = false;
+        close_sensor(loop, connection);
+    }
+    slotmap_destroy(loop->connections);
+    timer_wheel_destroy(loop->timeouts);
+    tcp_close(&loop->listener);
+    if (loop->uring != NULL) {
+        connmgr_uring_close(loop->uring);
+    } else {
+        close(loop->sensors);
+        close(loop->events);
+    }
+    if (loop->udp != NULL)
+        udp_close(loop->udp);
+}
+
+// Stops every loop, returns false if another loop already did.
+static bool stop_all(connmgr_t* connmgr) {
+    if (atomic_exchange(&connmgr->stopping, true))
+        return false;
+    uint64_t one = 1;
+    ASSERT_ELSE_PERROR(write(connmgr->stop, &one, sizeof(one)) == sizeof(one));
+    return true;
+}
+
+// Called when a wait for events timed out: quits the connmgr once no loop got anything for TIMEOUT.
+static void stop_if_idle(connmgr_t* connmgr, time_t now) {
+    if (now - atomic_load(&connmgr->lastReading) >= TIMEOUT && stop_all(connmgr))
+        printf("No sensor data received after " TO_STRING(TIMEOUT) " seconds. Quitting server.\n");
+}
+
+static void note_activity(connmgr_t* connmgr, time_t now) {
+    if (atomic_load_explicit(&connmgr->lastReading, memory_order_relaxed) != now)
+        atomic_store_explicit(&connmgr->lastReading, now, memory_order_relaxed);
+}
+
+// Called for a connection whose timeout is due: closes it if the sensor stayed silent for too long, or arms the timeout again.
+static void handle_timeout(timer_wheel_timer_t* timer, void* arg) {
+    connmgr_loop_t* loop = arg;
+    connection_t* connection = (connection_t*) ((char*) timer - offsetof(connection_t, timeout));
+    tcpsock_t* socket = connection->socket;
+    time_t lastSeen = *tcp_last_seen(socket) > loop->resumed ? *tcp_last_seen(socket) : loop->resumed;
+    if (timer->deadline > lastSeen + TIMEOUT) {
+        printf("Sensor with id %d timed out. \n", *tcp_last_seen_sensor_id(socket));
+        close_sensor(loop, connection);
+    } else {
+        arm_timeout(loop, connection, lastSeen);
+    }
+}
 
-    bool active = true;
-    struct pollfd* fds = NULL;
-    int nrOfSensorValues = 0;
+// Closes the connections of sensors that stayed silent for too long. Only the timeouts that are due are looked at.
+static void close_timed_out(connmgr_loop_t* loop, time_t now) {
+    timer_wheel_advance(loop->timeouts, now, handle_timeout, loop);
+}
+
+// How long a loop may wait for events: it wakes up every second while sensors are connected, to time them out.
+static int wait_timeout_ms(connmgr_loop_t* loop) {
+    return timer_wheel_is_empty(loop->timeouts) ? TIMEOUT * 1000 : 1000;
+}
 
-    while (active 
+static void* run_loop(void* arg) {
+    connmgr_loop_t* loop = arg;
+    connmgr_t* connmgr = loop->connmgr;
+    struct epoll_event ready[CONNMGR_MAX_EVENTS];
+
+    while (!atomic_load_explicit(&connmgr->stopping, memory_order_relaxed)
     //&& (nrOfSensorValues < 100)
     ) {
-        fds = realloc(fds, vector_size(sockets) * sizeof(*fds));
-
-        for (size_t i = 0; i < vector_size(sockets); i++) {
-            tcpsock_t* socket = vector_at(sockets, i);
-            fds[i] = (struct pollfd){
-                .fd = socket->sd,
-                .events = POLLIN,
-            };
+        // while paused, only new connections are accepted and the sensor data stays in the sockets
+        const bool paused = atomic_load(&readingPaused);
+        if (paused == loop->watchingSensors) {
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+            ASSERT_ELSE_PERROR(epoll_ctl(loop->events, paused ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, loop->sensors, &event) == 0);
+            loop->watchingSensors = !paused;
+            if (!paused)
+                loop->resumed = time(NULL);
         }
 
-        int n = poll(fds, vector_size(sockets), TIMEOUT * 1000);
-        assert(n != -1);
+        int n = epoll_wait(loop->events, ready, 3, paused ? PAUSED_POLL_MS : wait_timeout_ms(loop));
+        if (n == -1 && errno == EINTR)
+            continue;
+        ASSERT_ELSE_PERROR(n != -1);
 
-        if (n == 0) {
-            // quit the connmgr (TIMEOUT was reached)
-            printf("No sensor data received after " TO_STRING(TIMEOUT) " seconds. Quitting server.\n");
-            active = false;
-        } else {
-            // loop over sockets
-            size_t size = vector_size(sockets); // cache up front because some sockets may get added
-            for (size_t i = 0; i < size; i++) {
-                tcpsock_t* socket = vector_at(sockets, i);
-                if (i != 0 && time(NULL) > *tcp_last_seen(socket) + TIMEOUT) {
-                    printf("Sensor with id %d timed out. \n", *tcp_last_seen_sensor_id(socket));
-                    tcp_close(&socket);
-                    vector_remove_at_index(sockets, i);
-                    break;
-                } else if ((fds[i].revents & POLLIN) != 0) {
-                    *tcp_last_seen(socket) = time(NULL);
-                    if (i == 0) { // a new sensor is connected
-                        tcpsock_t* new_socket = NULL;
-                        tcp_wait_for_connection(socket, &new_socket);
-                        // this does not invalidate our loop since we only iterate over the original sockets
-                        vector_add(sockets, new_socket);
-                    } else { // data from existing connection is obtained
-                        sensor_data_t data;
-                        int bytes = sizeof(data.id);
-                        tcp_receive(socket, &data.id, &bytes);
-
-                        bytes = sizeof(data.value);
-                        tcp_receive(socket, &data.value, &bytes);
-
-                        bytes = sizeof(data.ts);
-                        const int result = tcp_receive(socket, &data.ts, &bytes);
-
-                        if (!socket->announced) {
-                            printf("A new sensor with id = %" PRIu16 " has opened a new connection\n", data.id);
-                            socket->announced = true;
-                        }
-
-                        if ((result == TCP_NO_ERROR) && bytes) {
-                            *tcp_last_seen_sensor_id(socket) = data.id;
-#if DEBUG
-                            ASSERT_ELSE_PERROR(write(fd, &data.id, sizeof(data.id)) == sizeof(data.id));
-                            ASSERT_ELSE_PERROR(write(fd, &data.value, sizeof(data.value)) == sizeof(data.value));
-                            ASSERT_ELSE_PERROR(write(fd, &data.ts, sizeof(data.ts)) == sizeof(data.ts));
-#endif
-                            nrOfSensorValues++;
-                            printf("sensor id = %" PRIu16 " - temperature = %g - timestamp = %ld  [%d]\n", data.id, data.value, data.ts, nrOfSensorValues);
-
-                            int ret = sbuffer_insert_first(buffer, &data);
-                            assert(ret == SBUFFER_SUCCESS);
-
-                        } else if (result == TCP_CONNECTION_CLOSED) {
-                            printf("Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(socket));
-                            tcp_close(&socket);
-                            vector_remove_at_index(sockets, i);
-                            break;
-                        }
+        // the stop eventfd only becomes readable after 'stopping' is set, so it's never handled as a socket
+        if (atomic_load(&connmgr->stopping))
+            break;
+        // the clock is read once per wakeup, every event handled in it gets the same time
+        const time_t now = time(NULL);
+        if (!paused)
+            close_timed_out(loop, now);
+        if (n == 0 && paused) {
+            // keep waiting for the buffer to drain
+            continue;
+        } else if (n == 0) {
+            stop_if_idle(connmgr, now);
+            continue;
+        }
+        note_activity(connmgr, now);
+
+        for (int i = 0; i < n; i++) {
+            if (ready[i].data.ptr == loop->listener) { // a new sensor is connected
+                // accept everything that is pending, a reconnect storm would otherwise take one wakeup per sensor
+                tcpsock_t* new_socket = NULL;
+                while (tcp_accept_connection(loop->listener, &new_socket) == TCP_NO_ERROR)
+                    add_sensor(loop, new_socket);
+            } else { // data from existing connections is obtained, only look at the ones that are ready
+                int count = epoll_wait(loop->sensors, ready + n, CONNMGR_MAX_EVENTS - n, 0);
+                ASSERT_ELSE_PERROR(count != -1 || errno == EINTR);
+                for (int j = n; j < n + count; j++) {
+                    if (ready[j].data.u64 == SLOTMAP_NO_HANDLE) {
+                        receive_datagrams(connmgr, loop->udp);
+                        continue;
                     }
+                    connection_t* connection = slotmap_get(loop->connections, ready[j].data.u64);
+                    *tcp_last_seen(connection->socket) = now;
+                    if (!receive_readings(connmgr, connection))
+                        close_sensor(loop, connection);
                 }
             }
         }
+        // one fsync of the write-ahead log for everything this wakeup inserted
+        sbuffer_sync(connmgr->buffer);
     }
-    free(fds);
+    return NULL;
+}
+
+// Handles a completion of the multishot receive of 'connection'.
+static void handle_receive(connmgr_loop_t* loop, connection_t* connection, const connmgr_uring_event_t* event, time_t now) {
+    if (event->res > 0 && !connection->closing) {
+        *tcp_last_seen(connection->socket) = now;
+        if (!consume_readings(loop->connmgr, connection, event->data, event->res))
+            close_sensor(loop, connection);
+    }
+    if (event->buffer >= 0)
+        connmgr_uring_recycle(loop->uring, event->buffer);
+    if (event->more)
+        return;
+
+    // the receive is done: it was cancelled, the sensor disconnected, or it ran out of buffers (or is just rearmed)
+    if (!connection->closing && (event->res > 0 || event->res == -ENOBUFS)) {
+        connmgr_uring_recv(loop->uring, connection->socket->sd, connection);
+        return;
+    }
+    connection->receiving = false;
+    if (!connection->closing)
+        printf("Sensor with id %" PRIu16 " disconnected\n", *tcp_last_seen_sensor_id(connection->socket));
+    close_sensor(loop, connection);
+}
+
+// Same as run_loop, on io_uring. Completions are reaped in batches, so most readings cost no system call.
+// While paused, completions are left in the ring: the multishot receives stop once the provided buffers
+// run out, and the rest of the sensor data stays in the sockets.
+static void* run_loop_uring(void* arg) {
+    connmgr_loop_t* loop = arg;
+    connmgr_t* connmgr = loop->connmgr;
+    connmgr_uring_event_t ready[CONNMGR_MAX_EVENTS];
+    const struct timespec pausedPoll = {.tv_sec = 0, .tv_nsec = PAUSED_POLL_MS * 1000000L};
+
+    while (!atomic_load_explicit(&connmgr->stopping, memory_order_relaxed)) {
+        if (atomic_load(&readingPaused)) {
+            loop->watchingSensors = false;
+            nanosleep(&pausedPoll, NULL);
+            continue;
+        }
+        if (!loop->watchingSensors) {
+            loop->watchingSensors = true;
+            loop->resumed = time(NULL);
+        }
+
+        int n = connmgr_uring_wait(loop->uring, ready, CONNMGR_MAX_EVENTS, wait_timeout_ms(loop));
+        if (n == -1)
+            continue;
+        if (atomic_load(&connmgr->stopping))
+            break;
+        const time_t now = time(NULL);
+        close_timed_out(loop, now);
+        if (n == 0) {
+            stop_if_idle(connmgr, now);
+            continue;
+        }
+        note_activity(connmgr, now);
+
+        for (int i = 0; i < n; i++) {
+            const connmgr_uring_event_t* event = &ready[i];
+            if (event->tag == loop->listener) { // new sensors are connected
+                tcpsock_t* new_socket = NULL;
+                if (event->res >= 0 && tcp_adopt_connection(event->res, &new_socket) == TCP_NO_ERROR)
+                    add_sensor(loop, new_socket);
+                else if (event->res >= 0)
+                    close(event->res);
+                if (!event->more)
+                    connmgr_uring_accept(loop->uring, loop->listener->sd, loop->listener);
+            } else if (event->tag == loop->udp) { // datagrams came in
+                receive_datagrams(connmgr, loop->udp);
+                connmgr_uring_poll(loop->uring, loop->udp->fd, loop->udp);
+            } else if (event->tag == &connmgr->stop) { // the connmgr stops after this batch
+                continue;
+            } else {
+                handle_receive(loop, event->tag, event, now);
+            }
+        }
+        sbuffer_sync(connmgr->buffer);
+    }
+    return NULL;
+}
+
+void connmgr_listen(const connmgr_config_t* config, sbuffer_t* buffer) {
+    assert(config && buffer);
+    connmgr_t connmgr = {
+        .buffer = buffer,
+        .debugFd = -1,
+        .stop = eventfd(0, EFD_CLOEXEC),
+        .stopping = false,
+        .lastReading = time(NULL),
+        .nrOfSensorValues = 0,
+    };
+    ASSERT_ELSE_PERROR(connmgr.stop >= 0);
 #if DEBUG
-    close(fd);
+    connmgr.debugFd = open("sensor_data_recv", O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+    assert(connmgr.debugFd > 0);
 #endif
 
-    for (size_t i = 0; i < vector_size(sockets); i++) {
-        tcpsock_t* socket = vector_at(sockets, i);
-        tcp_close(&socket);
+    // every loop listens on the port itself, so the kernel spreads the new connections over them,
+    // the datagrams all go to the first loop
+    int threads = config->threads > 0 ? config->threads : 1;
+    assert(threads <= CONNMGR_MAX_THREADS);
+    connmgr_loop_t* loops = malloc(threads * sizeof(*loops));
+    assert(loops != NULL);
+    connmgr_uring_t** urings = calloc(threads, sizeof(*urings));
+    assert(urings != NULL);
+    bool useUring = config->backend == CONNMGR_IO_URING;
+    for (int i = 0; i < threads && useUring; i++) {
+        urings[i] = connmgr_uring_open(CONNMGR_URING_BUFFERS, CONNMGR_RECEIVE_BUFFER);
+        if (urings[i] == NULL) {
+            printf("io_uring is not available, the connmgr falls back on epoll\n");
+            useUring = false;
+            for (int j = 0; j < i; j++)
+                connmgr_uring_close(urings[j]);
+        }
     }
-    vector_destroy(sockets);
+    for (int i = 0; i < threads; i++)
+        loop_init(&loops[i], &connmgr, config, threads > 1, useUring ? urings[i] : NULL, i == 0 ? config->udpPort : 0);
+    free(urings);
+
+    // the calling thread runs the first loop
+    void* (*run)(void*) = useUring ? run_loop_uring : run_loop;
+    for (int i = 1; i < threads; i++)
+        ASSERT_ELSE_PERROR(pthread_create(&loops[i].thread, NULL, run, &loops[i]) == 0);
+    run(&loops[0]);
+    for (int i = 1; i < threads; i++)
+        ASSERT_ELSE_PERROR(pthread_join(loops[i].thread, NULL) == 0);
+
+    for (int i = 0; i < threads; i++)
+        loop_free(&loops[i]);
+    free(loops);
+#if DEBUG
+    close(connmgr.debugFd);
+#endif
+    close(connmgr.stop);
 }
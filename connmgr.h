@@ -14,9 +14,39 @@
 #include <time.h>
 #include <unistd.h>
 
+// max number of event loops
+#define CONNMGR_MAX_THREADS 64
+
+/**
+ * How the event loops learn about new connections and sensor data
+ */
+typedef enum {
+    CONNMGR_EPOLL,    // readiness: epoll says which sockets can be read, then they are read one by one
+    CONNMGR_IO_URING, // completions: multishot accept and receive, falls back on epoll if io_uring isn't available
+} connmgr_backend_t;
+
+typedef struct {
+    int port;    /**< TCP port the sensors connect to */
+    int threads; /**< number of event loops that accept and read sensor connections, 0 for 1, at most CONNMGR_MAX_THREADS */
+    int udpPort; /**< UDP port the sensors without a connection send their readings to, 0 for none */
+    int backlog; /**< pending connections per listening socket, 0 for CONNMGR_BACKLOG */
+    connmgr_backend_t backend;
+} connmgr_config_t;
+
 /*
     This method holds the core functionality of the connmgr.
     It starts listening on the given port and when when a sensor
     node connects it writes the data to a sensor_data_recv file.
+    With several threads, each one listens on the port with SO_REUSEPORT and
+    inserts in 'buffer' concurrently, so 'buffer' must then be created with
+    SBUFFER_MULTI_PRODUCER. It returns once no thread received anything for TIMEOUT.
+    With a UDP port, the first thread also receives readings sent as datagrams (see sensor_protocol.h).
+*/
+void connmgr_listen(const connmgr_config_t* config, sbuffer_t* buffer);
+
+/*
+    Watermark callback for the shared buffer (see sbuffer_config_t).
+    While the buffer is above its high watermark, the connmgr stops reading
+    from the sensor connections, so TCP flow control pushes back on the sensors.
 */
-void connmgr_listen(int port_number, sbuffer_t* buffer);
+void connmgr_buffer_watermark(void* arg, bool high);
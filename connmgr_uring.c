@@ -0,0 +1,328 @@
+/**
+ * \author Mathieu Erbas
+ *
+ * The submission and completion rings are shared with the kernel: this side
+ * writes the submission tail and the completion head, the kernel the other
+ * two, so those are accessed with acquire/release atomics. The provided
+ * buffers are one allocation of 'buffers' * 'bufferSize' bytes, registered as
+ * buffer group 0; the kernel picks one per receive and the connmgr hands it
+ * back with connmgr_uring_recycle once it parsed the bytes.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "connmgr_uring.h"
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// number of submission queue entries, the completion queue is CQ_FACTOR times larger
+#define SQ_ENTRIES 256
+#define CQ_FACTOR 8
+
+#define BUFFER_GROUP 0
+
+// how long connmgr_uring_open waits for its probe to complete
+#define PROBE_TIMEOUT_MS 1000
+
+struct connmgr_uring {
+    int fd;
+    void* ringMap;
+    size_t ringMapSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqQueued; // entries written after the tail the kernel knows about
+
+    unsigned* cqHead;
+    unsigned* cqTail;
+    struct io_uring_cqe* cqes;
+    unsigned cqMask;
+
+    struct io_uring_buf_ring* bufRing;
+    size_t bufRingSize;
+    unsigned buffers;
+    unsigned bufferSize;
+    unsigned char* bufferData;
+};
+
+static inline unsigned load_acquire(unsigned* p) {
+    return atomic_load_explicit((_Atomic unsigned*) p, memory_order_acquire);
+}
+
+static inline void store_release(unsigned* p, unsigned value) {
+    atomic_store_explicit((_Atomic unsigned*) p, value, memory_order_release);
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, args);
+}
+
+// Adds buffer 'buffer' at the tail of the provided buffer ring, without publishing the tail.
+static void add_buffer(connmgr_uring_t* uring, unsigned short tail, int buffer) {
+    struct io_uring_buf* buf = &uring->bufRing->bufs[tail & (uring->buffers - 1)];
+    buf->addr = (uintptr_t) (uring->bufferData + (size_t) buffer * uring->bufferSize);
+    buf->len = uring->bufferSize;
+    buf->bid = buffer;
+}
+
+static void publish_buffers(connmgr_uring_t* uring, unsigned short tail) {
+    atomic_store_explicit((_Atomic unsigned short*) &uring->bufRing->tail, tail, memory_order_release);
+}
+
+// Multishot receive (Linux 6.0) came after everything else the connmgr needs (5.19), and without it every
+// receive completes with -EINVAL. So one is armed on a socket pair, and must stay armed after receiving a byte.
+// The pair is then closed, and the receive's last completion reaped, so nothing of the probe is left.
+static bool probe_multishot_recv(connmgr_uring_t* uring) {
+    int pair[2];
+    ASSERT_ELSE_PERROR(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0);
+    connmgr_uring_recv(uring, pair[0], uring);
+    ASSERT_ELSE_PERROR(write(pair[1], "", 1) == 1);
+    bool supported = false;
+    for (;;) {
+        connmgr_uring_event_t event;
+        int n = connmgr_uring_wait(uring, &event, 1, PROBE_TIMEOUT_MS);
+        if (n == 0)
+            break; // no answer, the caller closes the ring anyway
+        if (n < 0)
+            continue;
+        if (event.buffer >= 0)
+            connmgr_uring_recycle(uring, event.buffer);
+        if (!event.more)
+            break;
+        // armed and still armed: the end of the stream completes it for good
+        supported = event.res == 1;
+        shutdown(pair[1], SHUT_WR);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return supported;
+}
+
+connmgr_uring_t* connmgr_uring_open(unsigned buffers, unsigned buffer_size) {
+    // the provided buffer ring needs a power of two number of entries
+    assert(buffers > 0 && (buffers & (buffers - 1)) == 0 && buffers <= 32768);
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    params.cq_entries = SQ_ENTRIES * CQ_FACTOR;
+    int fd = uring_setup(SQ_ENTRIES, &params);
+    if (fd < 0) {
+        perror("io_uring_setup failed");
+        return NULL;
+    }
+    // waiting with a timeout, not losing completions when the queue overflows, and one mapping for both rings
+    const unsigned needed = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP | IORING_FEAT_SINGLE_MMAP;
+    if ((params.features & needed) != needed) {
+        fprintf(stderr, "io_uring lacks features the connmgr needs\n");
+        close(fd);
+        return NULL;
+    }
+
+    connmgr_uring_t* uring = calloc(1, sizeof(*uring));
+    assert(uring != NULL);
+    uring->fd = fd;
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    uring->ringMapSize = sqSize > cqSize ? sqSize : cqSize;
+    uring->ringMap = mmap(NULL, uring->ringMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ASSERT_ELSE_PERROR(uring->ringMap != MAP_FAILED && uring->sqes != MAP_FAILED);
+
+    unsigned char* ring = uring->ringMap;
+    uring->sqHead = (unsigned*) (ring + params.sq_off.head);
+    uring->sqTail = (unsigned*) (ring + params.sq_off.tail);
+    uring->sqArray = (unsigned*) (ring + params.sq_off.array);
+    uring->sqMask = *(unsigned*) (ring + params.sq_off.ring_mask);
+    uring->sqEntries = params.sq_entries;
+    uring->cqHead = (unsigned*) (ring + params.cq_off.head);
+    uring->cqTail = (unsigned*) (ring + params.cq_off.tail);
+    uring->cqes = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+    uring->cqMask = *(unsigned*) (ring + params.cq_off.ring_mask);
+
+    // the provided buffer ring must be page aligned, so it gets its own mapping
+    uring->buffers = buffers;
+    uring->bufferSize = buffer_size;
+    uring->bufRingSize = buffers * sizeof(struct io_uring_buf);
+    uring->bufRing = mmap(NULL, uring->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_ELSE_PERROR(uring->bufRing != MAP_FAILED);
+    uring->bufferData = malloc((size_t) buffers * buffer_size);
+    assert(uring->bufferData != NULL);
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t) uring->bufRing,
+        .ring_entries = buffers,
+        .bgid = BUFFER_GROUP,
+    };
+    if (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        perror("Registering io_uring provided buffers failed");
+        munmap(uring->bufRing, uring->bufRingSize);
+        uring->bufRing = NULL;
+        connmgr_uring_close(uring);
+        return NULL;
+    }
+    for (unsigned i = 0; i < buffers; i++)
+        add_buffer(uring, i, i);
+    publish_buffers(uring, buffers);
+    if (!probe_multishot_recv(uring)) {
+        fprintf(stderr, "io_uring lacks multishot receive\n");
+        connmgr_uring_close(uring);
+        return NULL;
+    }
+    return uring;
+}
+
+void connmgr_uring_close(connmgr_uring_t* uring) {
+    assert(uring);
+    if (uring->bufRing != NULL) {
+        // unregistering is synchronous, so the kernel is done with the buffers after this
+        struct io_uring_buf_reg reg = {.bgid = BUFFER_GROUP};
+        ASSERT_ELSE_PERROR(uring_register(uring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1) == 0);
+        munmap(uring->bufRing, uring->bufRingSize);
+    }
+    free(uring->bufferData);
+    munmap(uring->sqes, uring->sqesSize);
+    munmap(uring->ringMap, uring->ringMapSize);
+    close(uring->fd);
+    free(uring);
+}
+
+// Hands the queued entries to the kernel, and waits for 'minComplete' completions (until 'timeout', if not NULL).
+static int submit(connmgr_uring_t* uring, unsigned minComplete, struct __kernel_timespec* timeout) {
+    unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg = {.ts = (uintptr_t) timeout};
+    if (timeout != NULL)
+        flags |= IORING_ENTER_EXT_ARG;
+    unsigned tail = *uring->sqTail + uring->sqQueued;
+    store_release(uring->sqTail, tail);
+    unsigned toSubmit = uring->sqQueued;
+    uring->sqQueued = 0;
+    return uring_enter(uring->fd, toSubmit, minComplete, flags, timeout ? &arg : NULL, timeout ? sizeof(arg) : 0);
+}
+
+static struct io_uring_sqe* get_sqe(connmgr_uring_t* uring) {
+    unsigned tail = *uring->sqTail + uring->sqQueued;
+    if (tail - load_acquire(uring->sqHead) >= uring->sqEntries) {
+        // the queue is full, let the kernel take what's in it
+        int submitted = submit(uring, 0, NULL);
+        ASSERT_ELSE_PERROR(submitted >= 0 || errno == EINTR);
+        tail = *uring->sqTail;
+        assert(tail - load_acquire(uring->sqHead) < uring->sqEntries);
+    }
+    unsigned index = tail & uring->sqMask;
+    uring->sqArray[index] = index;
+    uring->sqQueued++;
+    struct io_uring_sqe* sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void connmgr_uring_accept(connmgr_uring_t* uring, int fd, void* tag) {
+    struct io_uring_sqe* sqe = get_sqe(uring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t) tag;
+}
+
+void connmgr_uring_recv(connmgr_uring_t* uring, int fd, void* tag) {
+    struct io_uring_sqe* sqe = get_sqe(uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = (uintptr_t) tag;
+}
+
+void connmgr_uring_poll(connmgr_uring_t* uring, int fd, void* tag) {
+    struct io_uring_sqe* sqe = get_sqe(uring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uintptr_t) tag;
+}
+
+void connmgr_uring_cancel(connmgr_uring_t* uring, void* tag) {
+    struct io_uring_sqe* sqe = get_sqe(uring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) tag;
+    // the cancellation's own completion is recognized by its NULL tag
+    sqe->user_data = 0;
+}
+
+int connmgr_uring_wait(connmgr_uring_t* uring, connmgr_uring_event_t* events, int max, int timeout_ms) {
+    assert(uring && events && max > 0);
+    unsigned head = *uring->cqHead;
+    if (load_acquire(uring->cqTail) == head) {
+        struct __kernel_timespec timeout = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_nsec = (timeout_ms % 1000) * 1000000L,
+        };
+        if (submit(uring, 1, &timeout) < 0) {
+            ASSERT_ELSE_PERROR(errno == ETIME || errno == EINTR || errno == EBUSY);
+            if (errno == EINTR)
+                return -1;
+        }
+    } else if (uring->sqQueued > 0) {
+        ASSERT_ELSE_PERROR(submit(uring, 0, NULL) >= 0 || errno == EINTR);
+    }
+
+    int count = 0;
+    unsigned tail = load_acquire(uring->cqTail);
+    for (; head != tail && count < max; head++) {
+        struct io_uring_cqe* cqe = &uring->cqes[head & uring->cqMask];
+        if (cqe->user_data == 0)
+            continue; // a cancellation's own result, the cancelled request reports separately
+        connmgr_uring_event_t* event = &events[count++];
+        event->tag = (void*) (uintptr_t) cqe->user_data;
+        event->res = cqe->res;
+        event->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        event->buffer = -1;
+        event->data = NULL;
+        if ((cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+            event->buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            event->data = uring->bufferData + (size_t) event->buffer * uring->bufferSize;
+        }
+    }
+    store_release(uring->cqHead, head);
+    return count;
+}
+
+void connmgr_uring_recycle(connmgr_uring_t* uring, int buffer) {
+    assert(uring && buffer >= 0 && (unsigned) buffer < uring->buffers);
+    unsigned short tail = uring->bufRing->tail;
+    add_buffer(uring, tail, buffer);
+    publish_buffers(uring, tail + 1);
+}
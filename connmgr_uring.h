@@ -0,0 +1,71 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ *
+ * Minimal io_uring wrapper for the connmgr: multishot accept and multishot
+ * receive into a ring of provided buffers, with completions reaped in batches
+ * much like epoll_wait. Talks to the kernel through the raw system calls.
+ * Every request carries a 'tag' that comes back with its completions.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct connmgr_uring connmgr_uring_t;
+
+typedef struct {
+    void* tag;
+    int res;           // bytes received, the accepted descriptor, or -errno
+    bool more;         // the request stays armed and will complete again
+    int buffer;        // provided buffer holding the received bytes, -1 if none
+    const void* data;  // the received bytes
+} connmgr_uring_event_t;
+
+/**
+ * Creates a ring with 'buffers' provided receive buffers of 'buffer_size' bytes each
+ * \return the ring, or NULL if io_uring (or a feature the connmgr needs) isn't available
+ */
+connmgr_uring_t* connmgr_uring_open(unsigned buffers, unsigned buffer_size);
+
+/**
+ * Unregisters the provided buffers, unmaps the ring and closes its descriptor
+ * Armed requests aren't cancelled first: the kernel drops them along with the ring,
+ * so nothing may still refer to their tags once this is called.
+ */
+void connmgr_uring_close(connmgr_uring_t* uring);
+
+/**
+ * Queues a multishot accept on listening socket 'fd'
+ */
+void connmgr_uring_accept(connmgr_uring_t* uring, int fd, void* tag);
+
+/**
+ * Queues a multishot receive on 'fd', into the provided buffers
+ */
+void connmgr_uring_recv(connmgr_uring_t* uring, int fd, void* tag);
+
+/**
+ * Queues a one-shot wait for 'fd' to become readable
+ */
+void connmgr_uring_poll(connmgr_uring_t* uring, int fd, void* tag);
+
+/**
+ * Queues the cancellation of every request with tag 'tag'
+ */
+void connmgr_uring_cancel(connmgr_uring_t* uring, void* tag);
+
+/**
+ * Submits the queued requests and waits up to 'timeout_ms' for completions
+ * \return the number of completions copied to 'events' (at most 'max'), 0 on a timeout, -1 if interrupted
+ */
+int connmgr_uring_wait(connmgr_uring_t* uring, connmgr_uring_event_t* events, int max, int timeout_ms);
+
+/**
+ * Hands provided buffer 'buffer' back to the kernel, once its bytes have been used
+ */
+void connmgr_uring_recycle(connmgr_uring_t* uring, int buffer);
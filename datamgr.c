@@ -4,11 +4,13 @@
 
 #include "datamgr.h"
 
-#include "lib/vector.h"
+#include "lib/tdigest.h"
+#include "room_map.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,64 +30,417 @@
     #define SET_MAX_TEMP 25
 #endif
 
+// sensors per page of the sensor table, a power of 2
+#ifndef DATAMGR_PAGE_SIZE
+    #define DATAMGR_PAGE_SIZE 256
+#endif
+
+#define DATAMGR_PAGES ((1 << (8 * sizeof(sensor_id_t))) / DATAMGR_PAGE_SIZE)
+_Static_assert(DATAMGR_PAGES * DATAMGR_PAGE_SIZE == 1 << (8 * sizeof(sensor_id_t)), "DATAMGR_PAGE_SIZE must divide the number of sensor ids");
+
+// buckets per time window, a window reaches back between (DATAMGR_BUCKETS - 1) / DATAMGR_BUCKETS of its span and its span
+#ifndef DATAMGR_BUCKETS
+    #define DATAMGR_BUCKETS 4
+#endif
+
+// span of each datamgr_span_t in seconds, which is also the time constant of its EWMA
+static const time_t spanSeconds[DATAMGR_SPANS] = {
+    [DATAMGR_LAST_MINUTE] = 60,
+    [DATAMGR_LAST_15_MINUTES] = 15 * 60,
+    [DATAMGR_LAST_HOUR] = 60 * 60,
+};
+
+// The readings of a sensor with a timestamp in [epoch * span / DATAMGR_BUCKETS, (epoch + 1) * span / DATAMGR_BUCKETS)
+typedef struct {
+    time_t epoch;
+    uint32_t count; // 0 if the bucket is unused
+    double sum;
+    tdigest_t digest;
+} bucket_t;
+
+// Statistics over the time windows of a sensor, the same size however many readings it sends
 typedef struct {
-    uint16_t sensor_id;
-    time_t last_modified;
-    double buffer[RUN_AVG_LENGTH];
-    unsigned count;
-} sensor_t;
-
-static vector_t* sensors = NULL;
-
-static sensor_value_t sensor_running_average(sensor_t* sensor) {
-    sensor_value_t sum = 0;
-    for (int i = 0; i < RUN_AVG_LENGTH; i++) {
-        sum += sensor->buffer[i];
+    bool started;       // false until the first reading
+    sensor_ts_t latest; // timestamp of the most recent reading
+    double ewma[DATAMGR_SPANS];
+    bucket_t buckets[DATAMGR_SPANS][DATAMGR_BUCKETS]; // bucket 'epoch % DATAMGR_BUCKETS' of each window
+} sensor_stats_t;
+
+// alert state of a sensor, as of the last sweep
+#define ALERT_LOW (-1)
+#define ALERT_NONE 0
+#define ALERT_HIGH 1
+
+// The state of DATAMGR_PAGE_SIZE consecutive sensors, one array per field, so that a reading only touches
+// the fields it updates and the sweep runs through each field it reads as one contiguous array.
+// A sensor without readings has no window and a length of 0.
+typedef struct {
+    // updated with every reading
+    double sum[DATAMGR_PAGE_SIZE];          // of the readings in the window
+    double compensation[DATAMGR_PAGE_SIZE]; // Kahan compensation: the low-order bits 'sum' lost
+    uint32_t count[DATAMGR_PAGE_SIZE];      // readings in the window, between 'length' and 2 * 'length' once it is full
+    time_t last_modified[DATAMGR_PAGE_SIZE];
+    // set with the first reading
+    uint32_t length[DATAMGR_PAGE_SIZE]; // number of readings in the running average
+    double* window[DATAMGR_PAGE_SIZE];  // the last 'length' readings, the next one goes at count % length
+    sensor_stats_t* stats[DATAMGR_PAGE_SIZE];
+    uint16_t room[DATAMGR_PAGE_SIZE]; // index in the room map, ROOM_MAP_NONE without one
+    // the running average as last added to the room and zone aggregates
+    double average[DATAMGR_PAGE_SIZE];
+    // read by the sweep
+    double min[DATAMGR_PAGE_SIZE];
+    double max[DATAMGR_PAGE_SIZE];
+    int32_t alert[DATAMGR_PAGE_SIZE];
+} sensor_page_t;
+
+typedef struct {
+    sensor_id_t first;
+    sensor_id_t last;
+    sensor_value_t min;
+    sensor_value_t max;
+} thresholds_t;
+
+// The sum of the running averages of the sensors in a room or zone
+typedef struct {
+    double sum;
+    double compensation; // Kahan compensation: the low-order bits 'sum' lost
+    size_t sensors;
+} group_t;
+
+// The sensors are indexed directly by id. The table is split in pages that are only allocated
+// once one of their sensors sends a reading, so a worker only pays for the ids in its shard.
+struct datamgr {
+    sensor_page_t* pages[DATAMGR_PAGES];
+    unsigned defaultWindow;
+    datamgr_window_t* windows; // later ones take precedence
+    size_t windowCount;
+    thresholds_t* thresholds; // later ones take precedence
+    size_t thresholdCount;
+    const room_map_t* map; // NULL without rooms
+    group_t* rooms;        // one per room of 'map'
+    group_t* zones;        // one per zone of 'map'
+};
+
+// Adds 'value' to '*sum', without accumulating rounding errors.
+static void kahan_add(double* sum, double* compensation, double value) {
+    double y = value - *compensation;
+    double t = *sum + y;
+    *compensation = (t - *sum) - y;
+    *sum = t;
+}
+
+// Adds 'value' to the running sum of sensor 'i' of 'page'.
+static void sensor_sum_add(sensor_page_t* page, size_t i, double value) {
+    kahan_add(&page->sum[i], &page->compensation[i], value);
+}
+
+// Puts 'value' in the window of sensor 'i' of 'page', in place of the oldest reading once it is full.
+static void sensor_add_reading(sensor_page_t* page, size_t i, double value) {
+    uint32_t length = page->length[i];
+    double* slot = &page->window[i][page->count[i] % length];
+    if (page->count[i] >= length)
+        sensor_sum_add(page, i, -*slot);
+    *slot = value;
+    sensor_sum_add(page, i, value);
+    // 2 * length % length == length % length, so wrapping back to 'length' keeps the position
+    if (++page->count[i] == 2 * length)
+        page->count[i] = length;
+}
+
+// Averages the readings in the window of sensor 'i' of 'page', which isn't necessarily full.
+static sensor_value_t sensor_running_average(sensor_page_t* page, size_t i) {
+    uint32_t filled = page->count[i] < page->length[i] ? page->count[i] : page->length[i];
+    return filled > 0 ? page->sum[i] / filled : 0;
+}
+
+// Gives sensor 'i' of 'page' a window of 'length' readings, which keeps the most recent ones.
+static void sensor_resize_window(sensor_page_t* page, size_t i, uint32_t length) {
+    double* window = malloc(length * sizeof(*window));
+    assert(window);
+    uint32_t kept = page->count[i] < page->length[i] ? page->count[i] : page->length[i];
+    if (kept > length)
+        kept = length;
+    for (uint32_t j = 0; j < kept; j++)
+        window[j] = page->window[i][(page->count[i] - kept + j) % page->length[i]];
+    free(page->window[i]);
+    page->window[i] = window;
+    page->length[i] = length;
+    page->count[i] = 0;
+    page->sum[i] = page->compensation[i] = 0;
+    for (uint32_t j = 0; j < kept; j++)
+        sensor_add_reading(page, i, window[j]);
+}
+
+// Adds the reading 'value' at 'ts' to the time windows in 'stats'.
+static void stats_add_reading(sensor_stats_t* stats, double value, sensor_ts_t ts) {
+    // readings out of order count as 1 second apart, so they still move the EWMA
+    bool first = !stats->started;
+    stats->started = true;
+    time_t elapsed = first || ts <= stats->latest ? 1 : ts - stats->latest;
+    if (first || ts > stats->latest)
+        stats->latest = ts;
+    for (int span = 0; span < DATAMGR_SPANS; span++) {
+        double alpha = first ? 1 : -expm1(-(double) elapsed / spanSeconds[span]);
+        stats->ewma[span] += alpha * (value - stats->ewma[span]);
+
+        time_t epoch = ts / (spanSeconds[span] / DATAMGR_BUCKETS);
+        bucket_t* bucket = &stats->buckets[span][epoch % DATAMGR_BUCKETS];
+        if (bucket->count > 0 && bucket->epoch > epoch)
+            continue; // the bucket moved on already, the reading is too old for this window
+        if (bucket->count == 0 || bucket->epoch < epoch) {
+            bucket->epoch = epoch;
+            bucket->count = 0;
+            bucket->sum = 0;
+            tdigest_init(&bucket->digest);
+        }
+        bucket->count++;
+        bucket->sum += value;
+        tdigest_add(&bucket->digest, value);
+    }
+}
+
+// Moves the aggregates of the room and zone of sensor 'i' of 'page' to its current running average.
+static void datamgr_update_groups(datamgr_t* datamgr, sensor_page_t* page, size_t i) {
+    uint16_t room = page->room[i];
+    if (room == ROOM_MAP_NONE)
+        return;
+    double average = sensor_running_average(page, i);
+    double change = average - page->average[i];
+    page->average[i] = average;
+    kahan_add(&datamgr->rooms[room].sum, &datamgr->rooms[room].compensation, change);
+    uint16_t zone = room_map_zone_of(datamgr->map, room);
+    if (zone != ROOM_MAP_NONE)
+        kahan_add(&datamgr->zones[zone].sum, &datamgr->zones[zone].compensation, change);
+}
+
+// Returns the window length that applies to 'sensor_id'.
+static unsigned datamgr_window_length(datamgr_t* datamgr, sensor_id_t sensor_id) {
+    for (size_t i = datamgr->windowCount; i > 0; i--) {
+        const datamgr_window_t* window = &datamgr->windows[i - 1];
+        if (window->first <= sensor_id && sensor_id <= window->last)
+            return window->length;
+    }
+    return datamgr->defaultWindow;
+}
+
+// Returns the page of 'sensor_id' in the table, allocating it if needed.
+static sensor_page_t* datamgr_get_page(datamgr_t* datamgr, sensor_id_t sensor_id) {
+    size_t index = sensor_id / DATAMGR_PAGE_SIZE;
+    sensor_page_t* page = datamgr->pages[index];
+    if (page == NULL) {
+        page = calloc(1, sizeof(*page)); // initialize to zero
+        assert(page);
+        for (size_t i = 0; i < DATAMGR_PAGE_SIZE; i++) {
+            page->min[i] = SET_MIN_TEMP;
+            page->max[i] = SET_MAX_TEMP;
+        }
+        for (size_t t = 0; t < datamgr->thresholdCount; t++) {
+            const thresholds_t* thresholds = &datamgr->thresholds[t];
+            for (size_t i = 0; i < DATAMGR_PAGE_SIZE; i++) {
+                size_t id = index * DATAMGR_PAGE_SIZE + i;
+                if (thresholds->first <= id && id <= thresholds->last) {
+                    page->min[i] = thresholds->min;
+                    page->max[i] = thresholds->max;
+                }
+            }
+        }
+        datamgr->pages[index] = page;
     }
-    return sum / RUN_AVG_LENGTH;
+    return page;
 }
 
-static bool sensor_equals(void* s1, void* s2) {
-    return ((sensor_t*) s1)->sensor_id == ((sensor_t*) s2)->sensor_id;
+datamgr_t* datamgr_init(const datamgr_config_t* config) {
+    datamgr_t* datamgr = calloc(1, sizeof(*datamgr));
+    assert(datamgr);
+    datamgr->defaultWindow = config != NULL && config->window > 0 ? config->window : RUN_AVG_LENGTH;
+    datamgr->map = config != NULL ? config->rooms : NULL;
+    if (datamgr->map != NULL) {
+        datamgr->rooms = calloc(room_map_room_count(datamgr->map), sizeof(*datamgr->rooms));
+        datamgr->zones = calloc(room_map_zone_count(datamgr->map), sizeof(*datamgr->zones));
+        assert(datamgr->rooms && datamgr->zones);
+    }
+    for (size_t i = 0; config != NULL && i < config->windowCount; i++)
+        datamgr_set_window(datamgr, config->windows[i].first, config->windows[i].last, config->windows[i].length);
+    return datamgr;
 }
 
-static sensor_t* datamgr_find_sensor(uint16_t sensor_id) {
-    sensor_t sensor = {.sensor_id = sensor_id};
-    return vector_find(sensors, &sensor, sensor_equals);
+void datamgr_set_window(datamgr_t* datamgr, sensor_id_t first, sensor_id_t last, unsigned length) {
+    assert(length > 0 && length < INT32_MAX); // see sensor_add_reading and sweep_page
+    datamgr->windows = realloc(datamgr->windows, (datamgr->windowCount + 1) * sizeof(*datamgr->windows));
+    assert(datamgr->windows);
+    datamgr->windows[datamgr->windowCount++] = (datamgr_window_t){.first = first, .last = last, .length = length};
+
+    // the sensors that already have a window switch now, the others get theirs with their first reading
+    for (size_t index = first / DATAMGR_PAGE_SIZE; index <= last / DATAMGR_PAGE_SIZE; index++) {
+        sensor_page_t* page = datamgr->pages[index];
+        for (size_t i = 0; page != NULL && i < DATAMGR_PAGE_SIZE; i++) {
+            size_t id = index * DATAMGR_PAGE_SIZE + i;
+            if (page->window[i] != NULL && first <= id && id <= last && page->length[i] != length) {
+                sensor_resize_window(page, i, length);
+                datamgr_update_groups(datamgr, page, i);
+            }
+        }
+    }
 }
 
-void datamgr_init() {
-    sensors = vector_create();
-    assert(sensors);
+void datamgr_set_thresholds(datamgr_t* datamgr, sensor_id_t first, sensor_id_t last, sensor_value_t min, sensor_value_t max) {
+    datamgr->thresholds = realloc(datamgr->thresholds, (datamgr->thresholdCount + 1) * sizeof(*datamgr->thresholds));
+    assert(datamgr->thresholds);
+    datamgr->thresholds[datamgr->thresholdCount++] = (thresholds_t){.first = first, .last = last, .min = min, .max = max};
+
+    for (size_t index = first / DATAMGR_PAGE_SIZE; index <= last / DATAMGR_PAGE_SIZE; index++) {
+        sensor_page_t* page = datamgr->pages[index];
+        for (size_t i = 0; page != NULL && i < DATAMGR_PAGE_SIZE; i++) {
+            size_t id = index * DATAMGR_PAGE_SIZE + i;
+            if (first <= id && id <= last) {
+                page->min[i] = min;
+                page->max[i] = max;
+            }
+        }
+    }
 }
 
-void datamgr_process_reading(const sensor_data_t* data) {
-    sensor_t* obtained_sensor = datamgr_find_sensor(data->id);
-    if (!obtained_sensor) { // sensor with id not found
+void datamgr_process_reading(datamgr_t* datamgr, const sensor_data_t* data) {
+    sensor_page_t* page = datamgr_get_page(datamgr, data->id);
+    size_t i = data->id % DATAMGR_PAGE_SIZE;
+    if (page->window[i] == NULL) { // sensor with id not found
         printf("Received sensor data with new sensor node id %d \n", data->id);
-        // put new sensor in sensor list
-        obtained_sensor = calloc(1, sizeof(*obtained_sensor)); // initialize to zero
-        obtained_sensor->sensor_id = data->id;
-        vector_add(sensors, obtained_sensor);
+        page->length[i] = datamgr_window_length(datamgr, data->id);
+        page->window[i] = malloc(page->length[i] * sizeof(*page->window[i]));
+        assert(page->window[i]);
+        page->stats[i] = calloc(1, sizeof(*page->stats[i]));
+        assert(page->stats[i]);
+        page->room[i] = datamgr->map != NULL ? room_map_room_of(datamgr->map, data->id) : ROOM_MAP_NONE;
+        if (page->room[i] != ROOM_MAP_NONE) {
+            datamgr->rooms[page->room[i]].sensors++;
+            uint16_t zone = room_map_zone_of(datamgr->map, page->room[i]);
+            if (zone != ROOM_MAP_NONE)
+                datamgr->zones[zone].sensors++;
+        }
+    }
+
+    page->last_modified[i] = data->ts;
+    sensor_add_reading(page, i, data->value);
+    stats_add_reading(page->stats[i], data->value, data->ts);
+    datamgr_update_groups(datamgr, page, i);
+}
+
+// Fills out 'stats' from 'group', which is NULL if it doesn't exist.
+static bool group_get_stats(const group_t* group, datamgr_group_stats_t* stats) {
+    if (group == NULL)
+        return false;
+    *stats = (datamgr_group_stats_t){
+        .sensors = group->sensors,
+        .sum = group->sum,
+        .average = group->sensors > 0 ? group->sum / group->sensors : 0,
+    };
+    return true;
+}
+
+bool datamgr_get_room_stats(datamgr_t* datamgr, uint16_t room, datamgr_group_stats_t* stats) {
+    bool exists = datamgr->map != NULL && room < room_map_room_count(datamgr->map);
+    return group_get_stats(exists ? &datamgr->rooms[room] : NULL, stats);
+}
+
+bool datamgr_get_zone_stats(datamgr_t* datamgr, uint16_t zone, datamgr_group_stats_t* stats) {
+    bool exists = datamgr->map != NULL && zone < room_map_zone_count(datamgr->map);
+    return group_get_stats(exists ? &datamgr->zones[zone] : NULL, stats);
+}
+
+bool datamgr_get_stats(datamgr_t* datamgr, sensor_id_t sensor_id, datamgr_span_t span, sensor_ts_t now, datamgr_stats_t* stats) {
+    assert(span >= 0 && span < DATAMGR_SPANS);
+    sensor_page_t* page = datamgr->pages[sensor_id / DATAMGR_PAGE_SIZE];
+    size_t i = sensor_id % DATAMGR_PAGE_SIZE;
+    if (page == NULL || page->stats[i] == NULL)
+        return false;
+
+    const sensor_stats_t* sensor = page->stats[i];
+    time_t epoch = now / (spanSeconds[span] / DATAMGR_BUCKETS);
+    tdigest_t digest;
+    tdigest_init(&digest);
+    double sum = 0;
+    *stats = (datamgr_stats_t){.ewma = sensor->ewma[span]};
+    for (int b = 0; b < DATAMGR_BUCKETS; b++) {
+        const bucket_t* bucket = &sensor->buckets[span][b];
+        if (bucket->count == 0 || bucket->epoch > epoch || bucket->epoch <= epoch - DATAMGR_BUCKETS)
+            continue;
+        stats->count += bucket->count;
+        sum += bucket->sum;
+        tdigest_merge(&digest, &bucket->digest);
     }
+    if (stats->count > 0) {
+        stats->mean = sum / stats->count;
+        stats->p50 = tdigest_quantile(&digest, 0.5);
+        stats->p95 = tdigest_quantile(&digest, 0.95);
+    }
+    return true;
+}
 
-    obtained_sensor->last_modified = data->ts;
-    obtained_sensor->buffer[obtained_sensor->count % RUN_AVG_LENGTH] = data->value;
-    obtained_sensor->count++;
+// Computes the running average of every sensor in 'page', whether it has readings (1 or 0),
+// and its alert state (as a double). Only sensors with a full window get an alert.
+// The loop has no branches and only produces doubles, so the compiler can vectorize it, even with plain SSE2.
+static void sweep_page(const sensor_page_t* page, double* average, double* live, double* alert) {
+    for (size_t i = 0; i < DATAMGR_PAGE_SIZE; i++) {
+        uint32_t filled = page->count[i] < page->length[i] ? page->count[i] : page->length[i];
+        uint32_t full = (page->length[i] > 0) & (filled == page->length[i]);
+        double avg = page->sum[i] / (int32_t) (filled + (filled == 0)); // never divides by 0
+        average[i] = avg;
+        live[i] = filled > 0 ? 1.0 : 0.0;
+        alert[i] = (full ? 1.0 : 0.0) * ((avg > page->max[i] ? ALERT_HIGH : 0.0) + (avg < page->min[i] ? ALERT_LOW : 0.0));
+    }
+}
 
-    sensor_value_t running_average = sensor_running_average(obtained_sensor);
-    if (obtained_sensor->count >= RUN_AVG_LENGTH) {
-        if (running_average < SET_MIN_TEMP) {
-            printf("Sensor %" PRIu16 " read a temperature value (%f) lower than " TO_STRING(SET_MIN_TEMP) "\n", data->id, data->value);
+datamgr_summary_t datamgr_sweep(datamgr_t* datamgr) {
+    datamgr_summary_t summary = {0};
+    double average[DATAMGR_PAGE_SIZE];
+    double live[DATAMGR_PAGE_SIZE];
+    double alert[DATAMGR_PAGE_SIZE];
+    double total = 0;
+    for (size_t index = 0; index < DATAMGR_PAGES; index++) {
+        sensor_page_t* page = datamgr->pages[index];
+        if (page == NULL)
+            continue;
+        sweep_page(page, average, live, alert);
+        for (size_t i = 0; i < DATAMGR_PAGE_SIZE; i++) {
+            summary.sensors += live[i] > 0;
+            summary.low += alert[i] == ALERT_LOW;
+            summary.high += alert[i] == ALERT_HIGH;
+            total += live[i] * average[i];
         }
-        if (running_average > SET_MAX_TEMP) {
-            printf("Sensor %" PRIu16 " read a temperature value (%f) higher than " TO_STRING(SET_MAX_TEMP) "\n", data->id, data->value);
+        // only the sensors whose alert state changed are left for the scalar loop
+        for (size_t i = 0; i < DATAMGR_PAGE_SIZE; i++) {
+            int32_t state = alert[i];
+            if (state == page->alert[i])
+                continue;
+            sensor_id_t id = index * DATAMGR_PAGE_SIZE + i;
+            // alerts name the room, so they can be grouped
+            char where[32] = "";
+            if (page->room[i] != ROOM_MAP_NONE)
+                snprintf(where, sizeof(where), " in room %" PRIu16, room_map_room_id(datamgr->map, page->room[i]));
+            if (state == ALERT_LOW)
+                printf("Sensor %" PRIu16 "%s has an average temperature (%f) lower than %g\n", id, where, average[i], page->min[i]);
+            else if (state == ALERT_HIGH)
+                printf("Sensor %" PRIu16 "%s has an average temperature (%f) higher than %g\n", id, where, average[i], page->max[i]);
+            else
+                printf("Sensor %" PRIu16 "%s has an average temperature (%f) back between %g and %g\n", id, where, average[i], page->min[i], page->max[i]);
+            page->alert[i] = state;
         }
     }
+    summary.average = summary.sensors > 0 ? total / summary.sensors : 0;
+    return summary;
 }
 
-void datamgr_free() {
-    for (size_t i = 0; i < vector_size(sensors); i++)
-        free(vector_at(sensors, i));
-    vector_destroy(sensors);
+void datamgr_free(datamgr_t* datamgr) {
+    for (size_t i = 0; i < DATAMGR_PAGES; i++) {
+        for (size_t j = 0; datamgr->pages[i] != NULL && j < DATAMGR_PAGE_SIZE; j++) {
+            free(datamgr->pages[i]->window[j]);
+            free(datamgr->pages[i]->stats[j]);
+        }
+        free(datamgr->pages[i]);
+    }
+    free(datamgr->windows);
+    free(datamgr->thresholds);
+    free(datamgr->rooms);
+    free(datamgr->zones);
+    free(datamgr);
 }
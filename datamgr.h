@@ -9,22 +9,132 @@
 #endif
 
 #include "config.h"
+#include "room_map.h"
 
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 /**
- * Initializes the data manager
+ * A data manager keeps the running averages of the sensors it sees,
+ * and reports the ones that are out of their thresholds when it sweeps them.
+ * Every datamgr worker has its own, so they need no locking as long as
+ * each sensor's readings go to one worker.
  */
-void datamgr_init();
+typedef struct datamgr datamgr_t;
+
+/**
+ * The number of readings in the running average of the sensors with ids 'first' up to and including 'last'
+ */
+typedef struct {
+    sensor_id_t first;
+    sensor_id_t last;
+    unsigned length;
+} datamgr_window_t;
+
+typedef struct {
+    unsigned window; /**< readings in the running average of a sensor without a datamgr_window_t, 0 for RUN_AVG_LENGTH */
+    const datamgr_window_t* windows; /**< when several apply to a sensor, the last one wins */
+    size_t windowCount;
+    const room_map_t* rooms; /**< the rooms to aggregate the sensors by, NULL for none; must outlive the datamgr */
+} datamgr_config_t;
+
+/**
+ * The time windows over which datamgr_get_stats reports, based on the timestamps of the readings
+ */
+typedef enum {
+    DATAMGR_LAST_MINUTE,
+    DATAMGR_LAST_15_MINUTES,
+    DATAMGR_LAST_HOUR,
+    DATAMGR_SPANS,
+} datamgr_span_t;
+
+/**
+ * The readings of a sensor in a time window
+ */
+typedef struct {
+    size_t count;        /**< number of readings in the window */
+    sensor_value_t mean; /**< 0 without readings, like the quantiles */
+    sensor_value_t ewma; /**< exponentially weighted moving average, with the span of the window as time constant */
+    sensor_value_t p50;  /**< estimated median */
+    sensor_value_t p95;  /**< estimated 95th percentile */
+} datamgr_stats_t;
+
+/**
+ * The running averages of the sensors in a room or zone
+ * With several datamgr workers, each one only aggregates the sensors in its shard,
+ * so the stats of a room are the sums of what every worker reports.
+ */
+typedef struct {
+    size_t sensors;         /**< sensors with at least one reading */
+    sensor_value_t sum;     /**< of their running averages */
+    sensor_value_t average; /**< of their running averages, 0 without sensors */
+} datamgr_group_stats_t;
+
+/**
+ * What the last sweep found
+ */
+typedef struct {
+    size_t sensors;         /**< sensors with at least one reading */
+    size_t low;             /**< sensors with an average below their min threshold */
+    size_t high;            /**< sensors with an average above their max threshold */
+    sensor_value_t average; /**< average of the running averages */
+} datamgr_summary_t;
+
+/**
+ * Initializes a data manager, with an empty sensor table
+ * \param config the running average windows, or NULL for RUN_AVG_LENGTH readings for every sensor
+ */
+datamgr_t* datamgr_init(const datamgr_config_t* config);
+
+/**
+ * Averages the last 'length' readings of the sensors with ids 'first' up to and including 'last' from now on
+ * Sensors that already have readings keep the most recent ones that fit in the new window.
+ */
+void datamgr_set_window(datamgr_t* datamgr, sensor_id_t first, sensor_id_t last, unsigned length);
+
+/**
+ * Sets the thresholds of the sensors with ids 'first' up to and including 'last', which start out at
+ * SET_MIN_TEMP and SET_MAX_TEMP
+ */
+void datamgr_set_thresholds(datamgr_t* datamgr, sensor_id_t first, sensor_id_t last, sensor_value_t min, sensor_value_t max);
 
 /**
  * processes a single temperature measurement
+ * This only updates the running average of the sensor, datamgr_sweep checks it against the thresholds.
+ */
+void datamgr_process_reading(datamgr_t* datamgr, const sensor_data_t* data);
+
+/**
+ * Reports the readings of 'sensor_id' in the time window 'span' that ends at 'now'
+ * Every sensor keeps a fixed number of buckets per window, each one with a quantile sketch,
+ * so the window actually reaches back between (DATAMGR_BUCKETS - 1) / DATAMGR_BUCKETS (3/4 by default)
+ * of its span and its span, and the quantiles are estimates.
+ * The EWMA covers every reading up to the most recent one.
+ * \return false if the sensor has no readings
+ */
+bool datamgr_get_stats(datamgr_t* datamgr, sensor_id_t sensor_id, datamgr_span_t span, sensor_ts_t now, datamgr_stats_t* stats);
+
+/**
+ * Reports the sensors in room 'room', an index in the room map of the config
+ * The aggregates are kept up to date with every reading, so this costs O(1).
+ * \return false if there is no such room
+ */
+bool datamgr_get_room_stats(datamgr_t* datamgr, uint16_t room, datamgr_group_stats_t* stats);
+
+/**
+ * Same as datamgr_get_room_stats, for zone 'zone', an index in the room map of the config
+ */
+bool datamgr_get_zone_stats(datamgr_t* datamgr, uint16_t zone, datamgr_group_stats_t* stats);
+
+/**
+ * Checks the running average of every sensor with a full window against its thresholds,
+ * and prints the sensors that went out of them or came back since the previous sweep
+ * \return the number of sensors and alerts, and the average over all sensors
  */
-void datamgr_process_reading(const sensor_data_t* data);
+datamgr_summary_t datamgr_sweep(datamgr_t* datamgr);
 
 /**
  * This method cleans up the datamgr, and frees all used memory.
  */
-void datamgr_free();
+void datamgr_free(datamgr_t* datamgr);
@@ -0,0 +1,111 @@
+#include "slotmap.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define NO_SLOT UINT32_MAX
+
+// A handle is the number of its slot in the low half, and the generation of the slot in the high half.
+// A slot's generation changes every time its element is removed, so older handles no longer match it.
+typedef struct {
+    uint32_t generation;
+    uint32_t index; // position of the element in 'elements', or the next free slot if the slot is free
+} slot_t;
+
+typedef struct slotmap {
+    slot_t* slots;
+    uint32_t slotCount;
+    uint32_t slotCapacity;
+    uint32_t freeSlot; // first free slot, they are chained through 'index'
+    void** elements;
+    uint32_t* owners; // slot of every element
+    uint32_t size;
+    uint32_t capacity;
+} slotmap_t;
+
+static void* grow(void* array, uint32_t* capacity, size_t elementSize) {
+    *capacity = *capacity > 0 ? *capacity * 2 : 16;
+    array = realloc(array, *capacity * elementSize);
+    assert(array != NULL);
+    return array;
+}
+
+static uint32_t slot_of(slotmap_handle_t handle) {
+    return (uint32_t) handle;
+}
+
+static uint32_t generation_of(slotmap_handle_t handle) {
+    return (uint32_t) (handle >> 32);
+}
+
+slotmap_t* slotmap_create() {
+    slotmap_t* map = calloc(1, sizeof(slotmap_t));
+    assert(map != NULL);
+    map->freeSlot = NO_SLOT;
+    return map;
+}
+
+slotmap_handle_t slotmap_insert(slotmap_t* map, void* element) {
+    assert(map);
+    uint32_t slot = map->freeSlot;
+    if (slot != NO_SLOT) {
+        map->freeSlot = map->slots[slot].index;
+    } else {
+        if (map->slotCount == map->slotCapacity)
+            map->slots = grow(map->slots, &map->slotCapacity, sizeof(*map->slots));
+        slot = map->slotCount++;
+        map->slots[slot].generation = 1; // so no handle is ever SLOTMAP_NO_HANDLE
+    }
+    if (map->size == map->capacity) {
+        uint32_t capacity = map->capacity;
+        map->elements = grow(map->elements, &map->capacity, sizeof(*map->elements));
+        map->owners = grow(map->owners, &capacity, sizeof(*map->owners));
+    }
+    map->elements[map->size] = element;
+    map->owners[map->size] = slot;
+    map->slots[slot].index = map->size++;
+    return (slotmap_handle_t) map->slots[slot].generation << 32 | slot;
+}
+
+void* slotmap_get(slotmap_t* map, slotmap_handle_t handle) {
+    assert(map);
+    uint32_t slot = slot_of(handle);
+    if (slot >= map->slotCount || map->slots[slot].generation != generation_of(handle))
+        return NULL;
+    return map->elements[map->slots[slot].index];
+}
+
+void slotmap_remove(slotmap_t* map, slotmap_handle_t handle) {
+    assert(slotmap_get(map, handle) != NULL);
+    slot_t* slot = &map->slots[slot_of(handle)];
+    // the last element takes the place of the removed one
+    uint32_t last = --map->size;
+    map->elements[slot->index] = map->elements[last];
+    map->owners[slot->index] = map->owners[last];
+    map->slots[map->owners[last]].index = slot->index;
+    map->elements[last] = NULL; // to help debugging
+
+    if (++slot->generation == 0)
+        slot->generation = 1;
+    slot->index = map->freeSlot;
+    map->freeSlot = slot_of(handle);
+}
+
+size_t slotmap_size(slotmap_t* map) {
+    assert(map);
+    return map->size;
+}
+
+void* slotmap_at(slotmap_t* map, size_t index) {
+    assert(map);
+    assert(index < map->size);
+    return map->elements[index];
+}
+
+void slotmap_destroy(slotmap_t* map) {
+    assert(map);
+    free(map->slots);
+    free(map->elements);
+    free(map->owners);
+    free(map);
+}
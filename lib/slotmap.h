@@ -0,0 +1,49 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Unordered collection of pointers with O(1) insert, lookup and remove.
+ * Every element gets a handle that stays valid until it's removed, and
+ * lookups with the handle of a removed element fail instead of finding
+ * whatever took its place. The elements are also kept contiguous, so
+ * they can be walked by index, but removing one moves the last one in its place.
+ */
+
+typedef uint64_t slotmap_handle_t;
+
+#define SLOTMAP_NO_HANDLE ((slotmap_handle_t) 0) // never handed out
+
+typedef struct slotmap slotmap_t;
+
+slotmap_t* slotmap_create();
+
+/**
+ * Adds 'element' to the map
+ * \return the handle of 'element'
+ */
+slotmap_handle_t slotmap_insert(slotmap_t* map, void* element);
+
+/**
+ * \return the element with handle 'handle', or NULL if it was removed
+ */
+void* slotmap_get(slotmap_t* map, slotmap_handle_t handle);
+
+/**
+ * Removes the element with handle 'handle', which must be in the map
+ */
+void slotmap_remove(slotmap_t* map, slotmap_handle_t handle);
+
+size_t slotmap_size(slotmap_t* map);
+
+/**
+ * \return the element at position 'index', with 'index' < slotmap_size(map)
+ */
+void* slotmap_at(slotmap_t* map, size_t index);
+
+void slotmap_destroy(slotmap_t* map);
@@ -12,6 +12,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -47,21 +48,34 @@
 #define TYPE SOCK_STREAM       // streaming protool type
 #define PROTOCOL IPPROTO_TCP   // TCP protocol
 
+// max number of closed sockets kept for reuse, so a reconnect storm doesn't malloc per connection
+#ifndef TCP_POOL_SIZE
+    #define TCP_POOL_SIZE 4096
+#endif
+
 /**
  * Structure for holding the TCP socket information
  */
 
 static tcpsock_t* tcp_sock_create();
+static void tcp_sock_free(tcpsock_t* s);
 
-int tcp_passive_open(tcpsock_t** sock, int port) {
+int tcp_passive_open_config(tcpsock_t** sock, int port, const tcp_listen_config_t* config) {
     int result;
     struct sockaddr_in addr;
     TCP_ERR_HANDLER(((port < MIN_PORT) || (port > MAX_PORT)), return TCP_ADDRESS_ERROR);
+    TCP_ERR_HANDLER(config == NULL, return TCP_SOCKET_ERROR);
     tcpsock_t* s = tcp_sock_create();
     TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
-    s->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
+    s->sd = socket(PROTOCOLFAMILY, TYPE | (config->nonblocking ? SOCK_NONBLOCK : 0), PROTOCOL);
     TCP_DEBUG_PRINTF(s->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(s->sd < 0, free(s); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(s->sd < 0, tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    if (config->shared) {
+        int enable = 1;
+        result = setsockopt(s->sd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+        TCP_DEBUG_PRINTF(result == -1, "Setsockopt() failed with errno = %d [%s]", errno, strerror(errno));
+        TCP_ERR_HANDLER(result != 0, close(s->sd); tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    }
     // Construct the server address structure
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = PROTOCOLFAMILY;
@@ -69,22 +83,25 @@ int tcp_passive_open(tcpsock_t** sock, int port) {
     addr.sin_port = htons(port);
     result = bind(s->sd, (struct sockaddr*) &addr, sizeof(addr));
     TCP_DEBUG_PRINTF(result == -1, "Bind() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(s); return TCP_SOCKOP_ERROR);
-    result = listen(s->sd, MAX_PENDING);
+    TCP_ERR_HANDLER(result != 0, tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    result = listen(s->sd, config->backlog > 0 ? config->backlog : MAX_PENDING);
     TCP_DEBUG_PRINTF(result == -1, "Listen() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(s); return TCP_SOCKOP_ERROR);
-    s->ip_addr = NULL; // address set to INADDR_ANY - not a specific IP address
+    TCP_ERR_HANDLER(result != 0, tcp_sock_free(s); return TCP_SOCKOP_ERROR);
+    s->ip_addr = htonl(INADDR_ANY); // not a specific IP address
     s->port = port;
     s->cookie = MAGIC_COOKIE;
     *sock = s;
     return TCP_NO_ERROR;
 }
 
+int tcp_passive_open(tcpsock_t** sock, int port) {
+    return tcp_passive_open_config(sock, port, &(tcp_listen_config_t){.backlog = MAX_PENDING});
+}
+
 int tcp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
     struct sockaddr_in addr;
     tcpsock_t* client;
     int length, result;
-    char* p;
     TCP_ERR_HANDLER(((remote_port < MIN_PORT) || (remote_port > MAX_PORT)),
                     return TCP_ADDRESS_ERROR); // server port between 0 and MIN_PORT is allowed
     TCP_ERR_HANDLER(remote_ip == NULL, return TCP_ADDRESS_ERROR);
@@ -92,25 +109,22 @@ int tcp_active_open(tcpsock_t** sock, int remote_port, char* remote_ip) {
     TCP_ERR_HANDLER(client == NULL, return TCP_MEMORY_ERROR);
     client->sd = socket(PROTOCOLFAMILY, TYPE, PROTOCOL);
     TCP_DEBUG_PRINTF(client->sd < 0, "Socket() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(client->sd < 0, free(client); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(client->sd < 0, tcp_sock_free(client); return TCP_SOCKOP_ERROR);
     /* Construct the server address structure */
     memset(&addr, 0, sizeof(struct sockaddr_in));
     addr.sin_family = PROTOCOLFAMILY;
     result = inet_aton(remote_ip, (struct in_addr*) &addr.sin_addr.s_addr);
-    TCP_ERR_HANDLER(result == 0, free(client); return TCP_ADDRESS_ERROR);
+    TCP_ERR_HANDLER(result == 0, tcp_sock_free(client); return TCP_ADDRESS_ERROR);
     addr.sin_port = htons(remote_port);
     result = connect(client->sd, (struct sockaddr*) &addr, sizeof(addr));
     TCP_DEBUG_PRINTF(result == -1, "Connect() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(client); return TCP_SOCKOP_ERROR);
+    TCP_ERR_HANDLER(result != 0, tcp_sock_free(client); return TCP_SOCKOP_ERROR);
     memset(&addr, 0, sizeof(struct sockaddr_in));
     length = sizeof(addr);
     result = getsockname(client->sd, (struct sockaddr*) &addr, (socklen_t*) &length);
     TCP_DEBUG_PRINTF(result == -1, "getsockname() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(result != 0, free(client); return TCP_SOCKOP_ERROR);
-    p = inet_ntoa(addr.sin_addr); // returns addr to statically allocated buffer
-    client->ip_addr = (char*) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(client->ip_addr == NULL, free(client); return TCP_MEMORY_ERROR);
-    client->ip_addr = strncpy(client->ip_addr, p, CHAR_IP_ADDR_LENGTH);
+    TCP_ERR_HANDLER(result != 0, tcp_sock_free(client); return TCP_SOCKOP_ERROR);
+    client->ip_addr = addr.sin_addr.s_addr;
     client->port = ntohs(addr.sin_port);
     client->cookie = MAGIC_COOKIE;
     *sock = client;
@@ -125,10 +139,6 @@ int tcp_close(tcpsock_t** socket) {
         return TCP_SOCKET_ERROR;
     if ((*socket)->cookie == MAGIC_COOKIE) // socket is bound
     {
-        if ((*socket)->ip_addr != NULL) // then assume memory is allocated and must be freed
-        {
-            free((*socket)->ip_addr);
-        }
         if ((*socket)->sd >= 0) {
             // maybe a connection is still open?
             result = shutdown((*socket)->sd, SHUT_RDWR);
@@ -144,35 +154,69 @@ int tcp_close(tcpsock_t** socket) {
     (*socket)->cookie = 0;
     (*socket)->port = -1;
     (*socket)->sd = -1;
-    (*socket)->ip_addr = NULL;
-    free(*socket);
+    (*socket)->ip_addr = 0;
+    tcp_sock_free(*socket);
     *socket = NULL;
     return TCP_NO_ERROR;
 }
 
-int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket) {
-    struct sockaddr_in addr;
+// Fills in the socket for connection 'sd' to the peer at 'addr'.
+static int accepted_socket(int sd, struct sockaddr_in* addr, tcpsock_t** new_socket) {
     tcpsock_t* s;
-    unsigned int length = sizeof(struct sockaddr_in);
-    char* p;
 
-    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
-    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
     s = tcp_sock_create();
     TCP_ERR_HANDLER(s == NULL, return TCP_MEMORY_ERROR);
-    s->sd = accept(socket->sd, (struct sockaddr*) &addr, &length);
-    TCP_DEBUG_PRINTF(s->sd == -1, "Accept() failed with errno = %d [%s]", errno, strerror(errno));
-    TCP_ERR_HANDLER(s->sd == -1, free(s); return TCP_SOCKOP_ERROR);
-    p = inet_ntoa(addr.sin_addr); // returns addr to statically allocated buffer
-    s->ip_addr = (char*) malloc(sizeof(char) * CHAR_IP_ADDR_LENGTH);
-    TCP_ERR_HANDLER(s->ip_addr == NULL, free(s); return TCP_MEMORY_ERROR);
-    s->ip_addr = strncpy(s->ip_addr, p, CHAR_IP_ADDR_LENGTH);
-    s->port = ntohs(addr.sin_port);
+    s->sd = sd;
+    s->ip_addr = addr->sin_addr.s_addr;
+    s->port = ntohs(addr->sin_port);
     s->cookie = MAGIC_COOKIE;
     *new_socket = s;
     return TCP_NO_ERROR;
 }
 
+int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket) {
+    struct sockaddr_in addr;
+    unsigned int length = sizeof(struct sockaddr_in);
+    int sd;
+
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    sd = accept(socket->sd, (struct sockaddr*) &addr, &length);
+    TCP_DEBUG_PRINTF(sd == -1, "Accept() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(sd == -1, return TCP_SOCKOP_ERROR);
+    int result = accepted_socket(sd, &addr, new_socket);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, close(sd));
+    return result;
+}
+
+int tcp_accept_connection(tcpsock_t* socket, tcpsock_t** new_socket) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(struct sockaddr_in);
+    int sd;
+
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    sd = accept4(socket->sd, (struct sockaddr*) &addr, &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    TCP_ERR_HANDLER(sd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK), return TCP_NO_CONNECTION);
+    TCP_DEBUG_PRINTF(sd == -1, "Accept4() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(sd == -1, return TCP_SOCKOP_ERROR);
+    int result = accepted_socket(sd, &addr, new_socket);
+    TCP_ERR_HANDLER(result != TCP_NO_ERROR, close(sd));
+    return result;
+}
+
+int tcp_adopt_connection(int sd, tcpsock_t** new_socket) {
+    struct sockaddr_in addr;
+    unsigned int length = sizeof(struct sockaddr_in);
+    int result;
+
+    TCP_ERR_HANDLER(sd < 0, return TCP_SOCKET_ERROR);
+    result = getpeername(sd, (struct sockaddr*) &addr, &length);
+    TCP_DEBUG_PRINTF(result == -1, "Getpeername() failed with errno = %d [%s]", errno, strerror(errno));
+    TCP_ERR_HANDLER(result != 0, return TCP_SOCKOP_ERROR);
+    return accepted_socket(sd, &addr, new_socket);
+}
+
 int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size) {
     TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
     TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
@@ -204,6 +248,7 @@ int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size) {
         return TCP_NO_ERROR;
     }
     *buf_size = recv(socket->sd, buffer, *buf_size, 0);
+    TCP_ERR_HANDLER((*buf_size < 0) && (errno == EAGAIN || errno == EWOULDBLOCK), *buf_size = 0; return TCP_NO_ERROR);
     TCP_DEBUG_PRINTF(*buf_size == 0, "Recv() : no connection to peer\n");
     TCP_ERR_HANDLER(*buf_size == 0, return TCP_CONNECTION_CLOSED);
     TCP_DEBUG_PRINTF((*buf_size < 0) && (errno == ENOTCONN), "Recv() : no connection to peer\n");
@@ -213,6 +258,14 @@ int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size) {
     return TCP_NO_ERROR;
 }
 
+int tcp_get_ip_addr(tcpsock_t* socket, char* ip_addr) {
+    TCP_ERR_HANDLER(socket == NULL, return TCP_SOCKET_ERROR);
+    TCP_ERR_HANDLER(socket->cookie != MAGIC_COOKIE, return TCP_SOCKET_ERROR);
+    struct in_addr addr = {.s_addr = socket->ip_addr};
+    TCP_ERR_HANDLER(inet_ntop(AF_INET, &addr, ip_addr, CHAR_IP_ADDR_LENGTH) == NULL, return TCP_ADDRESS_ERROR);
+    return TCP_NO_ERROR;
+}
+
 int* tcp_last_seen_sensor_id(tcpsock_t* socket) {
     return &socket->last_seen_sensor_id;
 }
@@ -221,12 +274,26 @@ time_t* tcp_last_seen(tcpsock_t* socket) {
     return &socket->last_seen;
 }
 
+// closed sockets, shared by all threads
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static tcpsock_t* pool = NULL;
+static int pooled = 0;
+
 static tcpsock_t* tcp_sock_create() {
-    tcpsock_t* s = (tcpsock_t*) malloc(sizeof(tcpsock_t));
+    pthread_mutex_lock(&poolLock);
+    tcpsock_t* s = pool;
+    if (s) {
+        pool = s->next_free;
+        pooled--;
+    }
+    pthread_mutex_unlock(&poolLock);
+    if (s == NULL)
+        s = (tcpsock_t*) malloc(sizeof(tcpsock_t));
     if (s) {           // init the socket to default values
         s->cookie = 0; // socket is not yet bound!
         s->port = -1;
-        s->ip_addr = NULL;
+        s->ip_addr = 0;
+        s->next_free = NULL;
         s->sd = -1;
         s->last_seen_sensor_id = -1;
         s->last_seen = time(NULL);
@@ -234,3 +301,16 @@ static tcpsock_t* tcp_sock_create() {
     }
     return s;
 }
+
+// Puts 's' in the pool, or frees it if the pool is full.
+static void tcp_sock_free(tcpsock_t* s) {
+    pthread_mutex_lock(&poolLock);
+    if (pooled < TCP_POOL_SIZE) {
+        s->next_free = pool;
+        pool = s;
+        pooled++;
+        s = NULL;
+    }
+    pthread_mutex_unlock(&poolLock);
+    free(s);
+}
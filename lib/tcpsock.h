@@ -12,6 +12,7 @@
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #define MIN_PORT 1024
@@ -23,21 +24,32 @@
 #define TCP_SOCKOP_ERROR 3      // socket operator (socket, listen, bind, accept,...) error
 #define TCP_CONNECTION_CLOSED 4 // send/receive indicate connection is closed
 #define TCP_MEMORY_ERROR 5      // mem alloc error
+#define TCP_NO_CONNECTION 6     // no connection setup request is pending on a non-blocking socket
 #define CHAR_IP_ADDR_LENGTH 16  // 4 numbers of 3 digits, 3 dots and \0
 #define MAX_PENDING 10
 
 struct tcpsock {
     long cookie; /**< if the socket is bound, cookie should be equal to MAGIC_COOKIE */
     // remark: the use of magic cookies doesn't guarantee a 'bullet proof' test
-    int sd;        /**< socket descriptor */
-    char* ip_addr; /**< socket IP address */
-    int port;      /**< socket port number */
+    int sd;           /**< socket descriptor */
+    uint32_t ip_addr; /**< socket IPv4 address in network byte order, INADDR_ANY for a listening socket */
+    int port;         /**< socket port number */
     int last_seen_sensor_id;
     time_t last_seen;
     bool announced;
+    struct tcpsock* next_free; /**< next socket in the pool of closed sockets */
 };
 typedef struct tcpsock tcpsock_t;
 
+/**
+ * How a listening socket is opened
+ */
+typedef struct {
+    int backlog;      /**< max number of pending connection setup requests, 0 for MAX_PENDING */
+    bool shared;      /**< set SO_REUSEPORT, so several sockets can listen on the same port */
+    bool nonblocking; /**< accepting never blocks, see tcp_accept_connection */
+} tcp_listen_config_t;
+
 /**
  * Creates a new socket and opens this socket in 'passive listening mode' (waiting for an active connection setup request)
  * The socket is bound to port number 'port' and to any active IP interface of the system
@@ -52,6 +64,15 @@ typedef struct tcpsock tcpsock_t;
  */
 int tcp_passive_open(tcpsock_t** socket, int port);
 
+/**
+ * Same as tcp_passive_open, with the backlog and options in 'config'
+ * \param socket a double pointer, that will be filled out with the newly created socket
+ * \param port a port number between MIN_PORT and MAX_PORT
+ * \param config how to open the socket
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_passive_open_config(tcpsock_t** socket, int port, const tcp_listen_config_t* config);
+
 /**
  * Creates a new TCP socket and opens a TCP connection to the system with IP address 'remote_ip' on port 'remote_port'
  * The newly created socket is return as '*socket'
@@ -90,6 +111,30 @@ int tcp_close(tcpsock_t** socket);
  */
 int tcp_wait_for_connection(tcpsock_t* socket, tcpsock_t** new_socket);
 
+/**
+ * Accepts a pending connection on the non-blocking listening socket 'socket', without waiting for one
+ * The connection is non-blocking too. Calling this until it returns TCP_NO_CONNECTION drains the backlog.
+ * If no connection setup request is pending, TCP_NO_CONNECTION is returned
+ * If memory allocation for the new socket fails, TCP_MEMORY_ERROR is returned
+ * If a socket operation fails, TCP_SOCKOP_ERROR is returned
+ * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
+ * \param socket the listening socket
+ * \param new_socket a double pointer, that will be filled out with the newly created socket for the connection with the client
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_accept_connection(tcpsock_t* socket, tcpsock_t** new_socket);
+
+/**
+ * Creates a socket for connection 'sd', which was accepted some other way (e.g. through io_uring)
+ * On success, the socket owns 'sd' and tcp_close closes it
+ * If memory allocation for the new socket fails, TCP_MEMORY_ERROR is returned
+ * If 'sd' isn't a connected socket, TCP_SOCKOP_ERROR or TCP_SOCKET_ERROR is returned
+ * \param sd the descriptor of the connection
+ * \param new_socket a double pointer, that will be filled out with the newly created socket
+ * \return TCP_NO_ERROR if no error occurs during execution
+ */
+int tcp_adopt_connection(int sd, tcpsock_t** new_socket);
+
 /**
  * Initiates a send command on the socket 'socket' and tries to send the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really sent, which might be less than the initial '*buf_size'
@@ -105,6 +150,7 @@ int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size);
 /**
  * Initiates a receive command on the socket 'socket' and tries to receive the total '*buf_size' bytes of data in 'buffer' (recall that the function might block for a while)
  * The function sets '*buf_size' to the number of bytes that were really received, which might be less than the inital '*buf_size'
+ * On a non-blocking socket without data, '*buf_size' is set to 0 and TCP_NO_ERROR is returned
  * If a socket error happens while receiving data or the connection is closed, TCP_SOCKOP_ERROR or TCP_CONNECTION_CLOSED is returned, respectively
  * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
  * \param socket the socket where the data needs to be received from
@@ -115,14 +161,13 @@ int tcp_send(tcpsock_t* socket, void* buffer, int* buf_size);
 int tcp_receive(tcpsock_t* socket, void* buffer, int* buf_size);
 
 /**
- * Set '*ip_addr' to the IP address of 'socket' (could be NULL if the IP address is not set)
- * No memory allocation is done (pointer reference assignment!), hence, no free must be called to avoid a memory leak
+ * Writes the IP address of 'socket' in dotted notation in 'ip_addr' ("0.0.0.0" for a listening socket)
  * If 'socket' is NULL or not yet bound, TCP_SOCKET_ERROR is returned
  * \param socket the socket to get the ip address from
- * \param ip_addr a pointer to a char* that can hold the ip address
+ * \param ip_addr an array of at least CHAR_IP_ADDR_LENGTH chars, that will be filled out with the ip address
  * \return TCP_NO_ERROR if no error occurs during execution
  */
-int tcp_get_ip_addr(tcpsock_t* socket, char** ip_addr);
+int tcp_get_ip_addr(tcpsock_t* socket, char* ip_addr);
 
 /**
  * Return the port number of the 'socket'
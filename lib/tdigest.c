@@ -0,0 +1,105 @@
+#include "tdigest.h"
+
+#include <assert.h>
+#include <string.h>
+
+void tdigest_init(tdigest_t* digest) {
+    assert(digest);
+    memset(digest, 0, sizeof(*digest));
+}
+
+// Merges the two adjacent centroids that are the smallest compared to the weight a centroid may have at their
+// quantile. That weight is proportional to q * (1 - q), which keeps the centroids in the tails small.
+static void compress(tdigest_t* digest, float* mean, uint32_t* weight, uint32_t size) {
+    uint32_t best = 0;
+    double bestCost = 0;
+    double before = 0; // total weight of the centroids before pair i
+    for (uint32_t i = 0; i + 1 < size; i++) {
+        double pair = (double) weight[i] + weight[i + 1];
+        double q = (before + pair / 2) / digest->count;
+        double limit = digest->count * q * (1 - q);
+        double cost = pair / (limit > 1e-9 ? limit : 1e-9);
+        if (i == 0 || cost < bestCost) {
+            best = i;
+            bestCost = cost;
+        }
+        before += weight[i];
+    }
+    double pair = (double) weight[best] + weight[best + 1];
+    mean[best] = (mean[best] * (double) weight[best] + mean[best + 1] * (double) weight[best + 1]) / pair;
+    weight[best] += weight[best + 1];
+    for (uint32_t i = best + 1; i + 1 < size; i++) {
+        mean[i] = mean[i + 1];
+        weight[i] = weight[i + 1];
+    }
+}
+
+// Adds a centroid of 'weight' values around 'value'.
+static void add_centroid(tdigest_t* digest, float value, uint32_t weight) {
+    // one spare place, so the new centroid goes in before the digest is compressed back to its size
+    float mean[TDIGEST_CENTROIDS + 1];
+    uint32_t weights[TDIGEST_CENTROIDS + 1];
+    uint32_t at = digest->size;
+    while (at > 0 && digest->mean[at - 1] > value)
+        at--;
+    memcpy(mean, digest->mean, at * sizeof(*mean));
+    memcpy(weights, digest->weight, at * sizeof(*weights));
+    mean[at] = value;
+    weights[at] = weight;
+    memcpy(mean + at + 1, digest->mean + at, (digest->size - at) * sizeof(*mean));
+    memcpy(weights + at + 1, digest->weight + at, (digest->size - at) * sizeof(*weights));
+
+    if (digest->count == 0 || value < digest->min)
+        digest->min = value;
+    if (digest->count == 0 || value > digest->max)
+        digest->max = value;
+    digest->count += weight;
+    uint32_t size = digest->size + 1;
+    if (size > TDIGEST_CENTROIDS) {
+        compress(digest, mean, weights, size);
+        size--;
+    }
+    memcpy(digest->mean, mean, size * sizeof(*mean));
+    memcpy(digest->weight, weights, size * sizeof(*weights));
+    digest->size = size;
+}
+
+void tdigest_add(tdigest_t* digest, double value) {
+    assert(digest);
+    add_centroid(digest, value, 1);
+}
+
+void tdigest_merge(tdigest_t* digest, const tdigest_t* other) {
+    assert(digest && other && digest != other);
+    if (other->count == 0)
+        return;
+    float min = digest->count == 0 || other->min < digest->min ? other->min : digest->min;
+    float max = digest->count == 0 || other->max > digest->max ? other->max : digest->max;
+    for (uint32_t i = 0; i < other->size; i++)
+        add_centroid(digest, other->mean[i], other->weight[i]);
+    digest->min = min;
+    digest->max = max;
+}
+
+double tdigest_quantile(const tdigest_t* digest, double q) {
+    assert(digest);
+    if (digest->count == 0)
+        return 0;
+    q = q < 0 ? 0 : q > 1 ? 1 : q;
+    // each centroid stands for its mean at the middle of its weight, values in between are interpolated
+    double target = q * digest->count;
+    double previousCenter = 0, previousMean = digest->min;
+    double before = 0;
+    for (uint32_t i = 0; i < digest->size; i++) {
+        double center = before + digest->weight[i] / 2.0;
+        if (target < center) {
+            double span = center - previousCenter;
+            return previousMean + (span > 0 ? (target - previousCenter) / span : 0) * (digest->mean[i] - previousMean);
+        }
+        previousCenter = center;
+        previousMean = digest->mean[i];
+        before += digest->weight[i];
+    }
+    double span = digest->count - previousCenter;
+    return previousMean + (span > 0 ? (target - previousCenter) / span : 0) * (digest->max - previousMean);
+}
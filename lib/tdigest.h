@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+
+/**
+ * t-digest: a quantile sketch that summarizes any number of values in a fixed number of centroids.
+ * Centroids near the median absorb many values, the ones in the tails only a few, so the extreme
+ * quantiles stay accurate. Two digests merge into one that summarizes both, which is how time
+ * windows are built out of smaller buckets.
+ * Digests are plain structs, so they can be embedded without allocating.
+ */
+
+// not overridable: the struct layout must be the same everywhere
+#define TDIGEST_CENTROIDS 12
+
+typedef struct {
+    uint32_t size;  // number of centroids in use
+    uint32_t count; // number of values added
+    float min;
+    float max;
+    float mean[TDIGEST_CENTROIDS]; // in increasing order
+    uint32_t weight[TDIGEST_CENTROIDS];
+} tdigest_t;
+
+/**
+ * Empties 'digest'
+ */
+void tdigest_init(tdigest_t* digest);
+
+/**
+ * Adds 'value' to 'digest'
+ */
+void tdigest_add(tdigest_t* digest, double value);
+
+/**
+ * Adds all values summarized by 'other' to 'digest'
+ */
+void tdigest_merge(tdigest_t* digest, const tdigest_t* other);
+
+/**
+ * Estimates quantile 'q' (between 0 and 1) of the values in 'digest'
+ * \return the estimate, 0 if 'digest' is empty
+ */
+double tdigest_quantile(const tdigest_t* digest, double q);
@@ -0,0 +1,100 @@
+#include "timer_wheel.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+// slot 'second % slotCount' holds the timers expiring in that second,
+// as a circular list that starts and ends at the slot itself
+typedef struct timer_wheel {
+    timer_wheel_timer_t* slots;
+    size_t slotCount;
+    time_t now;   // time of the last advance
+    size_t size;  // number of timers in the wheel
+} timer_wheel_t;
+
+timer_wheel_t* timer_wheel_create(size_t span, time_t now) {
+    assert(span > 0);
+    timer_wheel_t* wheel = malloc(sizeof(*wheel));
+    assert(wheel != NULL);
+    wheel->slotCount = span + 1;
+    wheel->slots = malloc(wheel->slotCount * sizeof(*wheel->slots));
+    assert(wheel->slots != NULL);
+    for (size_t i = 0; i < wheel->slotCount; i++)
+        wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+    wheel->now = now;
+    wheel->size = 0;
+    return wheel;
+}
+
+void timer_wheel_destroy(timer_wheel_t* wheel) {
+    assert(wheel);
+    free(wheel->slots);
+    free(wheel);
+}
+
+void timer_wheel_add(timer_wheel_t* wheel, timer_wheel_timer_t* timer, time_t deadline) {
+    assert(wheel && timer && timer->next == NULL);
+    timer->deadline = deadline;
+    // a deadline that passed already expires at the next advance, one that is too far away is looked at again later
+    time_t second = deadline;
+    if (second <= wheel->now)
+        second = wheel->now + 1;
+    else if (second > wheel->now + (time_t) wheel->slotCount - 1)
+        second = wheel->now + (time_t) wheel->slotCount - 1;
+    timer_wheel_timer_t* slot = &wheel->slots[second % wheel->slotCount];
+    timer->prev = slot->prev;
+    timer->next = slot;
+    slot->prev->next = timer;
+    slot->prev = timer;
+    wheel->size++;
+}
+
+void timer_wheel_remove(timer_wheel_t* wheel, timer_wheel_timer_t* timer) {
+    assert(wheel && timer);
+    if (timer->next == NULL)
+        return;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+    wheel->size--;
+}
+
+bool timer_wheel_is_empty(timer_wheel_t* wheel) {
+    assert(wheel);
+    return wheel->size == 0;
+}
+
+size_t timer_wheel_advance(timer_wheel_t* wheel, time_t now, void (*expired)(timer_wheel_timer_t* timer, void* arg), void* arg) {
+    assert(wheel && expired);
+    if (now <= wheel->now)
+        return 0;
+    time_t from = wheel->now + 1;
+    // after a long pause, every slot is visited once
+    if (now - from >= (time_t) wheel->slotCount)
+        from = now - (time_t) wheel->slotCount + 1;
+    wheel->now = now;
+
+    size_t count = 0;
+    for (time_t second = from; second <= now; second++) {
+        timer_wheel_timer_t* slot = &wheel->slots[second % wheel->slotCount];
+        if (slot->next == slot)
+            continue;
+        // take the whole list first: timers that aren't due yet go back in, possibly in this same slot
+        timer_wheel_timer_t* timer = slot->next;
+        slot->prev->next = NULL;
+        slot->prev = slot->next = slot;
+        while (timer != NULL) {
+            timer_wheel_timer_t* next = timer->next;
+            timer->prev = timer->next = NULL;
+            wheel->size--;
+            if (timer->deadline <= now) {
+                expired(timer, arg);
+                count++;
+            } else {
+                timer_wheel_add(wheel, timer, timer->deadline);
+            }
+            timer = next;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * Timer wheel with one slot per second. Timers are embedded in the objects they
+ * belong to, so adding and removing one never allocates and costs O(1).
+ * A deadline further away than the wheel reaches goes in the furthest slot
+ * and is put back in when that slot comes around.
+ */
+
+typedef struct timer_wheel_timer {
+    struct timer_wheel_timer* prev;
+    struct timer_wheel_timer* next; // NULL while the timer isn't in a wheel
+    time_t deadline;
+} timer_wheel_timer_t;
+
+typedef struct timer_wheel timer_wheel_t;
+
+/**
+ * Creates a wheel that starts at time 'now' and reaches 'span' seconds ahead
+ */
+timer_wheel_t* timer_wheel_create(size_t span, time_t now);
+
+/**
+ * Frees the wheel, the timers still in it are just forgotten
+ */
+void timer_wheel_destroy(timer_wheel_t* wheel);
+
+/**
+ * Adds 'timer', which isn't in a wheel, to expire once the time reaches 'deadline'
+ */
+void timer_wheel_add(timer_wheel_t* wheel, timer_wheel_timer_t* timer, time_t deadline);
+
+/**
+ * Removes 'timer' from the wheel, nothing happens if it isn't in it
+ */
+void timer_wheel_remove(timer_wheel_t* wheel, timer_wheel_timer_t* timer);
+
+/**
+ * Returns whether any timer is in the wheel
+ */
+bool timer_wheel_is_empty(timer_wheel_t* wheel);
+
+/**
+ * Moves the wheel forward to time 'now', and calls 'expired' for every timer with a deadline up to 'now'
+ * The timer is out of the wheel by then, so 'expired' may add it again or free it.
+ * \return the number of expired timers
+ */
+size_t timer_wheel_advance(timer_wheel_t* wheel, time_t now, void (*expired)(timer_wheel_timer_t* timer, void* arg), void* arg);
@@ -7,6 +7,7 @@
 typedef struct vector {
     void** elements;
     size_t size;
+    size_t capacity;
 } vector_t;
 
 vector_t* vector_create() {
@@ -15,9 +16,13 @@ vector_t* vector_create() {
 
 void vector_add(vector_t* vec, void* element) {
     assert(vec);
-    vec->size++;
-    vec->elements = realloc(vec->elements, vec->size * sizeof(*vec->elements));
-    vec->elements[vec->size - 1] = element;
+    if (vec->size == vec->capacity) {
+        // grows geometrically, so appending costs O(1) amortized
+        vec->capacity = vec->capacity > 0 ? vec->capacity * 2 : 16;
+        vec->elements = realloc(vec->elements, vec->capacity * sizeof(*vec->elements));
+        assert(vec->elements != NULL);
+    }
+    vec->elements[vec->size++] = element;
 }
 
 void vector_remove_at_index(vector_t* vec, size_t index) {
@@ -16,8 +16,35 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <wait.h>
 
+// max number of readings the shared buffer holds, and what happens when it is full
+#ifndef BUFFER_CAPACITY
+    #define BUFFER_CAPACITY 4096
+#endif
+
+#ifndef BUFFER_POLICY
+    #define BUFFER_POLICY SBUFFER_BLOCK
+#endif
+
+// define BUFFER_SPILL_DIR (e.g. -DBUFFER_SPILL_DIR=/var/tmp) to spill readings to disk instead of pausing the sensors
+// define BUFFER_WAL_DIR to log readings until they are stored, so they survive a crash and are stored on the next run
+
+// max number of -a options with a sensor id range
+#define MAX_WINDOWS 64
+
+// max number of readings a manager thread takes from the buffer at once
+#define TAKE_BATCH_SIZE 256
+// manager threads wait for data without a timeout: sbuffer_close wakes them up at shutdown
+// (a datamgr worker with readings left to sweep only waits until its next sweep)
+#define TAKE_TIMEOUT_MS (-1)
+
+// how often a datamgr worker checks its sensors against their thresholds
+#ifndef SWEEP_INTERVAL_MS
+    #define SWEEP_INTERVAL_MS 1000
+#endif
+
 static bool threadCanRun = false;
 
 static struct timespec timeRemaining;
@@ -31,10 +58,20 @@ static struct timespec timeRequested500ms = {
    };
 
 static int print_usage() {
-    printf("Usage: <command> <port number> \n");
+    printf("Usage: <command> [-w <datamgr workers, at most %d, 0 for one per core>] [-c <connmgr threads, at most %d, 0 for one per core>] [-u (io_uring)] [-d <UDP port>] [-b <connection backlog>] [-a [<first id>-<last id>=]<running average length>]... [-m <room map>] <port number> \n", SBUFFER_MAX_SHARDS, CONNMGR_MAX_THREADS);
     return -1;
 }
 
+// every datamgr worker processes the readings of the sensors in its shard of the buffer
+typedef struct {
+    sbuffer_t* buffer;
+    int shard;
+    const datamgr_config_t* config;
+    datamgr_group_stats_t* rooms; // what the worker's sensors add to every room and zone of the room map at shutdown
+    datamgr_group_stats_t* zones;
+    pthread_t thread;
+} datamgr_worker_t;
+
 static pthread_mutex_t threadCanRunMutex;
 
 // get the run flag, in a safe way
@@ -52,38 +89,91 @@ static void setThreadCanRun(bool canRun) {
   pthread_mutex_unlock(&threadCanRunMutex);
 }
 
-static void* datamgr_run(void* buffer) {  
-   datamgr_init();
+static void* datamgr_run(void* arg) {  
+    datamgr_worker_t* worker = arg;
+    datamgr_t* datamgr = datamgr_init(worker->config);
 
     // datamgr loop
+    sensor_data_t batch[TAKE_BATCH_SIZE];
+    struct timespec lastSweep;
+    clock_gettime(CLOCK_MONOTONIC, &lastSweep);
+    bool unswept = false; // readings were processed since the last sweep
     while (getThreadCanRun()) {        
+        // the averages only change with new readings: without any, wait for them without a timeout,
+        // otherwise only until the next sweep is due, so a shard that goes quiet still gets swept
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long sinceSweep = (now.tv_sec - lastSweep.tv_sec) * 1000 + (now.tv_nsec - lastSweep.tv_nsec) / 1000000;
+        if (unswept && sinceSweep >= SWEEP_INTERVAL_MS) {
+            datamgr_sweep(datamgr);
+            lastSweep = now;
+            unswept = false;
+            sinceSweep = 0;
+        }
+        int timeout = unswept ? SWEEP_INTERVAL_MS - sinceSweep : TAKE_TIMEOUT_MS;
+
         // datamgr waits on CV when no data is available to process
-        if(sbuffer_has_data_to_process(buffer)){
-            sensor_data_t data = sbuffer_get_last_to_process(buffer);
-            datamgr_process_reading(&data);
-            printf("sensor id = %d - temperature = %g - PROCESSED\n", data.id, data.value);        
-            //nanosleep(&timeRequested500ms, &timeRemaining);
+        size_t count = sbuffer_take_batch_to_process_shard(worker->buffer, worker->shard, batch, TAKE_BATCH_SIZE, timeout);
+        for (size_t i = 0; i < count; i++) {
+            datamgr_process_reading(datamgr, &batch[i]);
+            printf("sensor id = %d - temperature = %g - PROCESSED\n", batch[i].id, batch[i].value);
         }
+        unswept = unswept || count > 0;
     }
-    
-    datamgr_free();
 
-    printf("shutdown datamgr_run thread\n");
+    datamgr_summary_t summary = datamgr_sweep(datamgr);
+    printf("datamgr_run thread %d: %zu sensors, %zu too cold, %zu too hot, average %g\n", worker->shard,
+           summary.sensors, summary.low, summary.high, summary.average);
+    const room_map_t* map = worker->config->rooms;
+    for (size_t room = 0; map != NULL && room < room_map_room_count(map); room++)
+        datamgr_get_room_stats(datamgr, room, &worker->rooms[room]);
+    for (size_t zone = 0; map != NULL && zone < room_map_zone_count(map); zone++)
+        datamgr_get_zone_stats(datamgr, zone, &worker->zones[zone]);
+    datamgr_free(datamgr);
+
+    printf("shutdown datamgr_run thread %d\n", worker->shard);
     return NULL;
 }
 
+// Prints the averages of the rooms and zones that have sensors, over the sensors of all workers.
+static void print_rooms(const room_map_t* map, const datamgr_worker_t* workers, int count) {
+    for (size_t room = 0; room < room_map_room_count(map); room++) {
+        datamgr_group_stats_t total = {0};
+        for (int i = 0; i < count; i++) {
+            total.sensors += workers[i].rooms[room].sensors;
+            total.sum += workers[i].rooms[room].sum;
+        }
+        if (total.sensors > 0)
+            printf("Room %u: %zu sensors, average temperature %g\n", room_map_room_id(map, room), total.sensors, total.sum / total.sensors);
+    }
+    for (size_t zone = 0; zone < room_map_zone_count(map); zone++) {
+        datamgr_group_stats_t total = {0};
+        for (int i = 0; i < count; i++) {
+            total.sensors += workers[i].zones[zone].sensors;
+            total.sum += workers[i].zones[zone].sum;
+        }
+        if (total.sensors > 0)
+            printf("Zone %u: %zu sensors, average temperature %g\n", room_map_zone_id(map, zone), total.sensors, total.sum / total.sensors);
+    }
+}
+
 static void* storagemgr_run(void* buffer) {
+#ifdef BUFFER_WAL_DIR
+    // the readings replayed from the log belong with the ones already stored
+    DBCONN* db = storagemgr_init_connection(0);
+#else
     DBCONN* db = storagemgr_init_connection(1);
+#endif
     assert(db != NULL);
 
     // storagemgr loop
+    sensor_data_t batch[TAKE_BATCH_SIZE];
     while (getThreadCanRun()) {
-       // storagemgr waits on CV when no data is available to store
-       if(sbuffer_has_data_to_store(buffer)){
-            sensor_data_t data = sbuffer_get_last_to_store(buffer);
-            storagemgr_insert_sensor(db, data.id, data.value, data.ts);
-            printf("sensor id = %d - temperature = %g - STORED\n", data.id, data.value);
-            //nanosleep(&timeRequested500ms, &timeRemaining);
+        // storagemgr waits on CV when no data is available to store
+        size_t count = sbuffer_take_batch_to_store(buffer, batch, TAKE_BATCH_SIZE, TAKE_TIMEOUT_MS);
+        for (size_t i = 0; i < count; i++) {
+            storagemgr_insert_sensor(db, batch[i].id, batch[i].value, batch[i].ts);
+            printf("sensor id = %d - temperature = %g - STORED\n", batch[i].id, batch[i].value);
         }
     }
 
@@ -93,44 +183,144 @@ static void* storagemgr_run(void* buffer) {
     return NULL;
 }
 
-static void* removemgr_run(void* buffer) {  
-    // removemgr loop
-    while (getThreadCanRun()) {        
-        // removemgr waits on CV when no data is available to process
-        if(sbuffer_has_data_to_remove(buffer)){
-            sbuffer_remove_node(buffer);
+int main(int argc, char* argv[]) {
+    int workers = 1;
+    int connmgrThreads = 1;
+    connmgr_backend_t connmgrBackend = CONNMGR_EPOLL;
+    int udpPort = 0;
+    int backlog = 0;
+    datamgr_window_t windows[MAX_WINDOWS];
+    datamgr_config_t datamgrConfig = {.windows = windows};
+    const char* roomMapPath = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "w:c:ud:b:a:m:")) != -1) {
+        char* error_char = NULL;
+        switch (option) {
+        case 'w':
+            workers = strtol(optarg, &error_char, 10);
+            if (optarg[0] == '\0' || error_char[0] != '\0' || workers < 0 || workers > SBUFFER_MAX_SHARDS)
+                return print_usage();
+            break;
+        case 'c':
+            connmgrThreads = strtol(optarg, &error_char, 10);
+            if (optarg[0] == '\0' || error_char[0] != '\0' || connmgrThreads < 0 || connmgrThreads > CONNMGR_MAX_THREADS)
+                return print_usage();
+            break;
+        case 'u':
+            connmgrBackend = CONNMGR_IO_URING;
+            break;
+        case 'd':
+            udpPort = strtol(optarg, &error_char, 10);
+            if (optarg[0] == '\0' || error_char[0] != '\0' || udpPort <= 0)
+                return print_usage();
+            break;
+        case 'b':
+            backlog = strtol(optarg, &error_char, 10);
+            if (optarg[0] == '\0' || error_char[0] != '\0' || backlog <= 0)
+                return print_usage();
+            break;
+        case 'a': {
+            unsigned first, last, length;
+            int parsed = 0;
+            if (sscanf(optarg, "%u-%u=%u%n", &first, &last, &length, &parsed) == 3 && optarg[parsed] == '\0') {
+                if (first > last || last > UINT16_MAX || length == 0 || datamgrConfig.windowCount == MAX_WINDOWS)
+                    return print_usage();
+                windows[datamgrConfig.windowCount++] = (datamgr_window_t){.first = first, .last = last, .length = length};
+            } else if (sscanf(optarg, "%u%n", &length, &parsed) == 1 && optarg[parsed] == '\0' && length > 0) {
+                datamgrConfig.window = length;
+            } else {
+                return print_usage();
+            }
+            break;
+        }
+        case 'm':
+            roomMapPath = optarg;
+            break;
+        default:
+            return print_usage();
         }
     }
-    
-    printf("shutdown removemgr_run thread\n");
-    return NULL;
-}
+    // one per core, as far as the maximum allows
+    if (workers == 0)
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > SBUFFER_MAX_SHARDS)
+        workers = SBUFFER_MAX_SHARDS;
+    if (connmgrThreads == 0)
+        connmgrThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (connmgrThreads > CONNMGR_MAX_THREADS)
+        connmgrThreads = CONNMGR_MAX_THREADS;
 
-int main(int argc, char* argv[]) {
-    if (argc != 2)
+    if (argc - optind != 1)
         return print_usage();
-    char* strport = argv[1];
+    char* strport = argv[optind];
     char* error_char = NULL;
     int port_number = strtol(strport, &error_char, 10);
     if (strport[0] == '\0' || error_char[0] != '\0')
         return print_usage();
 
-    sbuffer_t* buffer = sbuffer_create();
+    room_map_t* roomMap = NULL;
+    if (roomMapPath != NULL) {
+        roomMap = room_map_load(roomMapPath);
+        if (roomMap == NULL)
+            return -1;
+        printf("Loaded %zu rooms in %zu zones from %s\n", room_map_room_count(roomMap), room_map_zone_count(roomMap), roomMapPath);
+        datamgrConfig.rooms = roomMap;
+    }
+
+    // the connmgr stops reading sensors above 3/4 of the capacity, and resumes below 1/4
+    sbuffer_config_t bufferConfig = {
+        .capacity = BUFFER_CAPACITY,
+        .policy = BUFFER_POLICY,
+        .high_watermark = BUFFER_CAPACITY * 3 / 4,
+        .low_watermark = BUFFER_CAPACITY / 4,
+        .on_watermark = connmgr_buffer_watermark,
+        .watermark_arg = NULL,
+        .process_shards = workers,
+        .producers = connmgrThreads > 1 ? SBUFFER_MULTI_PRODUCER : SBUFFER_SINGLE_PRODUCER,
+    };
+#ifdef BUFFER_SPILL_DIR
+    // the spill absorbs bursts, so keep reading the sensors
+    bufferConfig.high_watermark = bufferConfig.low_watermark = 0;
+    bufferConfig.on_watermark = NULL;
+    bufferConfig.spill_dir = TO_STRING(BUFFER_SPILL_DIR);
+#endif
+#ifdef BUFFER_WAL_DIR
+    bufferConfig.wal_dir = TO_STRING(BUFFER_WAL_DIR);
+#endif
+    sbuffer_t* buffer = sbuffer_create(&bufferConfig);
     
     // set flag to indicate threads can run
     ASSERT_ELSE_PERROR(pthread_mutex_init(&threadCanRunMutex, NULL) == 0);
     setThreadCanRun(1);
 
-    pthread_t datamgr_thread;
+    datamgr_worker_t datamgr_workers[SBUFFER_MAX_SHARDS];
     pthread_t storagemgr_thread;
-    pthread_t removemgr_thread;
 
-    ASSERT_ELSE_PERROR(pthread_create(&datamgr_thread, NULL, datamgr_run, buffer) == 0);
+    for (int shard = 0; shard < workers; shard++) {
+        datamgr_workers[shard] = (datamgr_worker_t){.buffer = buffer, .shard = shard, .config = &datamgrConfig};
+        if (roomMap != NULL) {
+            datamgr_workers[shard].rooms = calloc(room_map_room_count(roomMap), sizeof(datamgr_group_stats_t));
+            datamgr_workers[shard].zones = calloc(room_map_zone_count(roomMap), sizeof(datamgr_group_stats_t));
+            assert(datamgr_workers[shard].rooms && datamgr_workers[shard].zones);
+        }
+        ASSERT_ELSE_PERROR(pthread_create(&datamgr_workers[shard].thread, NULL, datamgr_run, &datamgr_workers[shard]) == 0);
+    }
     ASSERT_ELSE_PERROR(pthread_create(&storagemgr_thread, NULL, storagemgr_run, buffer) == 0);
-    ASSERT_ELSE_PERROR(pthread_create(&removemgr_thread, NULL, removemgr_run, buffer) == 0);
+
+    // readings a previous run accepted but didn't store go first
+    size_t replayed = sbuffer_replay_wal(buffer);
+    if (replayed > 0)
+        printf("Replayed %zu readings from the write-ahead log\n", replayed);
 
     // main server loop
-    connmgr_listen(port_number, buffer);
+    connmgr_config_t connmgrConfig = {
+        .port = port_number,
+        .threads = connmgrThreads,
+        .udpPort = udpPort,
+        .backlog = backlog,
+        .backend = connmgrBackend,
+    };
+    connmgr_listen(&connmgrConfig, buffer);
 
     // first, check if all sbuffer data has been processed + sbuffer is empty
     while (!sbuffer_is_empty(buffer))
@@ -147,10 +337,20 @@ int main(int argc, char* argv[]) {
     printf("Close the buffer\n");
     sbuffer_close(buffer);    
 
-    printf("Shutting down threads in 10 seconds ...\n");
+    printf("Shutting down threads ...\n");
     pthread_join(storagemgr_thread, NULL);
-    pthread_join(datamgr_thread, NULL);
-    pthread_join(removemgr_thread, NULL);
+    for (int shard = 0; shard < workers; shard++)
+        pthread_join(datamgr_workers[shard].thread, NULL);
+    if (roomMap != NULL)
+        print_rooms(roomMap, datamgr_workers, workers);
+    for (int shard = 0; shard < workers; shard++) {
+        free(datamgr_workers[shard].rooms);
+        free(datamgr_workers[shard].zones);
+    }
+    room_map_free(roomMap);
+
+    sbuffer_stats_t stats = sbuffer_get_stats(buffer);
+    printf("Buffer dropped %zu, rejected %zu and spilled %zu readings\n", stats.dropped, stats.rejected, stats.spilled);
 
     printf("Destroy the buffer\n");
     sbuffer_destroy(buffer);
@@ -0,0 +1,184 @@
+/**
+ * \author Mathieu Erbas
+ */
+
+#include "room_map.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SENSOR_IDS (1 << (8 * sizeof(sensor_id_t)))
+
+struct room_map {
+    uint16_t roomOf[SENSOR_IDS]; // room index of every sensor id
+    size_t roomCount;
+    room_id_t* roomIds;  // in increasing order
+    uint16_t* zoneOf;    // zone index of every room
+    size_t zoneCount;
+    zone_id_t* zoneIds;  // in increasing order
+};
+
+typedef struct {
+    unsigned room;
+    unsigned sensor;
+    unsigned zone; // ROOM_MAP_NONE without a zone id
+} line_t;
+
+static int compare_ids(const void* a, const void* b) {
+    return (int) *(const uint16_t*) a - (int) *(const uint16_t*) b;
+}
+
+// Sorts the 'count' ids in 'ids' and removes the duplicates, returns how many are left.
+static size_t sort_unique(uint16_t* ids, size_t count) {
+    qsort(ids, count, sizeof(*ids), compare_ids);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || ids[unique - 1] != ids[i])
+            ids[unique++] = ids[i];
+    }
+    return unique;
+}
+
+static uint16_t find(const uint16_t* ids, size_t count, uint16_t id) {
+    const uint16_t* found = bsearch(&id, ids, count, sizeof(*ids), compare_ids);
+    return found != NULL ? found - ids : ROOM_MAP_NONE;
+}
+
+// Reads the lines of 'file' into '*lines', returns false if one of them is malformed.
+static bool read_lines(FILE* file, const char* path, line_t** lines, size_t* count) {
+    size_t capacity = 0;
+    *lines = NULL;
+    *count = 0;
+    char text[256];
+    for (size_t number = 1; fgets(text, sizeof(text), file) != NULL; number++) {
+        line_t line = {.zone = ROOM_MAP_NONE};
+        char* start = text + strspn(text, " \t");
+        if (*start == '\n' || *start == '\0' || *start == '#')
+            continue;
+        int parsed = 0;
+        int fields = sscanf(start, "%u %u %n%u %n", &line.room, &line.sensor, &parsed, &line.zone, &parsed);
+        if (fields < 2 || start[parsed] != '\0' || line.room > UINT16_MAX || line.sensor >= SENSOR_IDS
+            || (fields == 3 && line.zone >= ROOM_MAP_NONE)) {
+            fprintf(stderr, "%s:%zu: expected <room id> <sensor id> [<zone id>]\n", path, number);
+            free(*lines);
+            return false;
+        }
+        if (*count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            *lines = realloc(*lines, capacity * sizeof(**lines));
+            assert(*lines);
+        }
+        (*lines)[(*count)++] = line;
+    }
+    return true;
+}
+
+room_map_t* room_map_load(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Can't open room map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    line_t* lines;
+    size_t count;
+    bool valid = read_lines(file, path, &lines, &count);
+    fclose(file);
+    if (!valid)
+        return NULL;
+
+    room_map_t* map = calloc(1, sizeof(*map));
+    assert(map);
+    map->roomIds = malloc((count + 1) * sizeof(*map->roomIds));
+    map->zoneIds = malloc((count + 1) * sizeof(*map->zoneIds));
+    assert(map->roomIds && map->zoneIds);
+    size_t zones = 0;
+    for (size_t i = 0; i < count; i++) {
+        map->roomIds[i] = lines[i].room;
+        if (lines[i].zone != ROOM_MAP_NONE)
+            map->zoneIds[zones++] = lines[i].zone;
+    }
+    map->roomCount = sort_unique(map->roomIds, count);
+    map->zoneCount = sort_unique(map->zoneIds, zones);
+    // the last index is ROOM_MAP_NONE, so there can be one room less than there are room ids
+    valid = map->roomCount < ROOM_MAP_NONE;
+    if (!valid)
+        fprintf(stderr, "%s: too many rooms\n", path);
+
+    map->zoneOf = malloc((map->roomCount + 1) * sizeof(*map->zoneOf));
+    assert(map->zoneOf);
+    for (size_t i = 0; i < map->roomCount; i++)
+        map->zoneOf[i] = ROOM_MAP_NONE;
+    for (size_t i = 0; i < SENSOR_IDS; i++)
+        map->roomOf[i] = ROOM_MAP_NONE;
+    bool* seen = calloc(map->roomCount + 1, sizeof(*seen)); // rooms that got their zone already
+    assert(seen);
+    for (size_t i = 0; valid && i < count; i++) {
+        uint16_t room = find(map->roomIds, map->roomCount, lines[i].room);
+        uint16_t zone = lines[i].zone != ROOM_MAP_NONE ? find(map->zoneIds, map->zoneCount, lines[i].zone) : ROOM_MAP_NONE;
+        if (map->roomOf[lines[i].sensor] != ROOM_MAP_NONE && map->roomOf[lines[i].sensor] != room) {
+            fprintf(stderr, "%s: sensor %u is in several rooms\n", path, lines[i].sensor);
+            valid = false;
+        }
+        map->roomOf[lines[i].sensor] = room;
+        if (seen[room] && map->zoneOf[room] != zone) {
+            fprintf(stderr, "%s: room %u is in several zones\n", path, lines[i].room);
+            valid = false;
+        }
+        seen[room] = true;
+        map->zoneOf[room] = zone;
+    }
+    free(seen);
+    free(lines);
+    if (!valid) {
+        room_map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+void room_map_free(room_map_t* map) {
+    if (map == NULL)
+        return;
+    free(map->roomIds);
+    free(map->zoneOf);
+    free(map->zoneIds);
+    free(map);
+}
+
+size_t room_map_room_count(const room_map_t* map) {
+    return map->roomCount;
+}
+
+size_t room_map_zone_count(const room_map_t* map) {
+    return map->zoneCount;
+}
+
+uint16_t room_map_room_of(const room_map_t* map, sensor_id_t sensor_id) {
+    return map->roomOf[sensor_id];
+}
+
+uint16_t room_map_zone_of(const room_map_t* map, uint16_t room) {
+    assert(room < map->roomCount);
+    return map->zoneOf[room];
+}
+
+room_id_t room_map_room_id(const room_map_t* map, uint16_t room) {
+    assert(room < map->roomCount);
+    return map->roomIds[room];
+}
+
+zone_id_t room_map_zone_id(const room_map_t* map, uint16_t zone) {
+    assert(zone < map->zoneCount);
+    return map->zoneIds[zone];
+}
+
+uint16_t room_map_find_room(const room_map_t* map, room_id_t room_id) {
+    return find(map->roomIds, map->roomCount, room_id);
+}
+
+uint16_t room_map_find_zone(const room_map_t* map, zone_id_t zone_id) {
+    return find(map->zoneIds, map->zoneCount, zone_id);
+}
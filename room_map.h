@@ -0,0 +1,69 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ *
+ * Which room every sensor is in, and which zone (e.g. a floor) every room is in.
+ * Rooms and zones are numbered densely in order of their ids, so per-room state fits in a plain array.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint16_t room_id_t;
+typedef uint16_t zone_id_t;
+
+// index of a sensor that isn't in a room, or of a room that isn't in a zone
+#define ROOM_MAP_NONE UINT16_MAX
+
+typedef struct room_map room_map_t;
+
+/**
+ * Loads the room map in 'path', with one sensor per line: <room id> <sensor id> [<zone id>]
+ * Empty lines and lines starting with '#' are skipped. A sensor is in one room at most, and
+ * the lines of a room either all have the same zone id or none.
+ * \return the room map, or NULL if the file can't be read or is malformed (which is printed on stderr)
+ */
+room_map_t* room_map_load(const char* path);
+
+void room_map_free(room_map_t* map);
+
+size_t room_map_room_count(const room_map_t* map);
+
+size_t room_map_zone_count(const room_map_t* map);
+
+/**
+ * Returns the index of the room of 'sensor_id', ROOM_MAP_NONE if the sensor isn't in the map
+ */
+uint16_t room_map_room_of(const room_map_t* map, sensor_id_t sensor_id);
+
+/**
+ * Returns the index of the zone of room 'room' (an index), ROOM_MAP_NONE if the room isn't in a zone
+ */
+uint16_t room_map_zone_of(const room_map_t* map, uint16_t room);
+
+/**
+ * Returns the id of room 'room' (an index)
+ */
+room_id_t room_map_room_id(const room_map_t* map, uint16_t room);
+
+/**
+ * Returns the id of zone 'zone' (an index)
+ */
+zone_id_t room_map_zone_id(const room_map_t* map, uint16_t zone);
+
+/**
+ * Returns the index of the room with id 'room_id', ROOM_MAP_NONE if it isn't in the map
+ */
+uint16_t room_map_find_room(const room_map_t* map, room_id_t room_id);
+
+/**
+ * Returns the index of the zone with id 'zone_id', ROOM_MAP_NONE if it isn't in the map
+ */
+uint16_t room_map_find_zone(const room_map_t* map, zone_id_t zone_id);
@@ -9,6 +9,8 @@
 #include "sbuffer.h"
 
 #include "config.h"
+#include "sbuffer_spill.h"
+#include "sbuffer_wal.h"
 
 #include <assert.h>
 #include <pthread.h>
@@ -17,47 +19,79 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
-#define SHUTDOWN_DELAY   10
-
 struct sbuffer_node {
     struct sbuffer_node* prev;
     sensor_data_t data;
-    int id;
-    bool isProcessed;
-    bool isStored;
+    size_t id; // sequence number, also used in the write-ahead log
+    int pending; // number of registered consumers that still have to take this node
+};
+
+struct sbuffer_consumer {
+    sbuffer_t* buffer;
+    sbuffer_node_t* next; // oldest node this consumer hasn't taken yet, NULL if it is up to date
+    size_t taken;         // id after the last node this consumer took
+    int shard;            // only takes the readings of sensors with id % shards == shard
+    int shards;
+    pthread_cond_t dataAvailable;
+    int waiting; // threads parked on dataAvailable, inserts only signal it when there are any
+    struct sbuffer_consumer* nextConsumer;
 };
 
 struct sbuffer {
     sbuffer_node_t* head;
     sbuffer_node_t* tail;
-    sbuffer_node_t* toProcess;
-    sbuffer_node_t* toStore;
+
+    sbuffer_consumer_t* consumers; // all registered consumers
+    int consumerCount;
+    sbuffer_consumer_t* toProcess[SBUFFER_MAX_SHARDS]; // the datamgr, one consumer per shard
+    int processShards;
+    sbuffer_consumer_t* toStore;   // the storagemgr
+
+    size_t count; // number of nodes in the list
+    size_t nextId;
+    sbuffer_config_t config;
+    bool aboveHighWatermark;
+    sbuffer_stats_t stats;
+    int insertWaiters;
+
+    // readings that arrive while 'spillThreshold' nodes are in the list go to the spill,
+    // and are moved back into the list (in order) as soon as nodes are released
+    sbuffer_spill_t* spill;
+    size_t spillThreshold;
+
+    // every accepted reading is logged under its node id, until the storagemgr took it
+    sbuffer_wal_t* wal;
+
+    // sbuffer_reserve hands out this staging area, reserveLock is held until sbuffer_commit
+    sensor_data_t* reserved;
+    sbuffer_node_t** reservedNodes; // the nodes sbuffer_commit copies the staging area into
+    size_t reservedCapacity;
+    size_t reservedCount;
+    pthread_mutex_t reserveLock;
 
     bool closed;    
 
     pthread_rwlock_t    rwlock;
-    pthread_cond_t      dataToRemove;
-    pthread_cond_t      new_Data_Available_Low_Priority;  
-    pthread_cond_t      new_Data_Available_High_Priority;
+    pthread_cond_t      spaceAvailable;
     pthread_mutex_t     mutex;
 };
 
 
 // -------------------------- CREATION -------------------------------------------
+// The id and pending count are only known once the node is inserted.
 static sbuffer_node_t* create_node(const sensor_data_t* data) {
-    static int node_counter = 0;
     sbuffer_node_t* node = malloc(sizeof(*node));
+    assert(node != NULL);
     *node = (sbuffer_node_t){
         .data = *data,
         .prev = NULL,
-        .id = ++node_counter,
-        .isProcessed = false,
-        .isStored = false,
+        .id = 0,
+        .pending = 0,
     };
     return node;
 }
 
-sbuffer_t* sbuffer_create() {
+sbuffer_t* sbuffer_create(const sbuffer_config_t* config) {
     sbuffer_t* buffer = malloc(sizeof(sbuffer_t));
     // should never fail due to optimistic memory allocation
     assert(buffer != NULL);
@@ -65,23 +99,124 @@ sbuffer_t* sbuffer_create() {
     buffer->head = NULL;
     buffer->tail = NULL;
     buffer->closed = false;
-    buffer->toProcess = NULL;
-    buffer->toStore = NULL;
+    buffer->consumers = NULL;
+    buffer->consumerCount = 0;
+    buffer->count = 0;
+    buffer->config = config ? *config : (sbuffer_config_t){.policy = SBUFFER_BLOCK};
+    buffer->aboveHighWatermark = false;
+    buffer->stats = (sbuffer_stats_t){0};
+    buffer->insertWaiters = 0;
+    buffer->spillThreshold = buffer->config.spill_threshold ? buffer->config.spill_threshold : buffer->config.capacity;
+    // an unbounded list without a threshold never needs to spill
+    buffer->spill = buffer->config.spill_dir && buffer->spillThreshold > 0 ? sbuffer_spill_open(buffer->config.spill_dir) : NULL;
+    buffer->wal = NULL;
+    if (buffer->config.wal_dir != NULL) {
+        buffer->wal = sbuffer_wal_open(buffer->config.wal_dir, buffer->config.wal_sync_ms);
+        ASSERT_ELSE_PERROR(buffer->wal != NULL);
+    }
+    // the log decides where the ids continue
+    buffer->nextId = buffer->wal ? sbuffer_wal_start(buffer->wal) : 0;
     ASSERT_ELSE_PERROR(pthread_rwlock_init(&buffer->rwlock, NULL) == 0);
-    ASSERT_ELSE_PERROR(pthread_cond_init(&buffer->new_Data_Available_Low_Priority, NULL) == 0);
-    ASSERT_ELSE_PERROR(pthread_cond_init(&buffer->new_Data_Available_High_Priority, NULL) == 0);
-    ASSERT_ELSE_PERROR(pthread_cond_init(&buffer->dataToRemove, NULL) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_init(&buffer->spaceAvailable, NULL) == 0);
     ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->mutex, NULL) == 0);
- 
+    buffer->reserved = NULL;
+    buffer->reservedNodes = NULL;
+    buffer->reservedCapacity = 0;
+    buffer->reservedCount = 0;
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->reserveLock, NULL) == 0);
+
+    buffer->processShards = buffer->config.process_shards > 0 ? buffer->config.process_shards : 1;
+    assert(buffer->processShards <= SBUFFER_MAX_SHARDS);
+    for (int shard = 0; shard < buffer->processShards; shard++)
+        buffer->toProcess[shard] = sbuffer_register_shard_consumer(buffer, shard, buffer->processShards);
+    buffer->toStore = sbuffer_register_consumer(buffer);
     return buffer;
 }
 
+// -------------------------- CONSUMERS -------------------------------------------
+
+sbuffer_consumer_t* sbuffer_register_consumer(sbuffer_t* buffer) {
+    return sbuffer_register_shard_consumer(buffer, 0, 1);
+}
+
+sbuffer_consumer_t* sbuffer_register_shard_consumer(sbuffer_t* buffer, int shard, int shards) {
+    assert(buffer && shards > 0 && shard >= 0 && shard < shards);
+    sbuffer_consumer_t* consumer = malloc(sizeof(*consumer));
+    assert(consumer != NULL);
+    consumer->buffer = buffer;
+    consumer->next = NULL;
+    consumer->shard = shard;
+    consumer->shards = shards;
+    consumer->waiting = 0;
+    ASSERT_ELSE_PERROR(pthread_cond_init(&consumer->dataAvailable, NULL) == 0);
+
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+    consumer->taken = buffer->nextId;
+    consumer->nextConsumer = buffer->consumers;
+    buffer->consumers = consumer;
+    buffer->consumerCount++;
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+    return consumer;
+}
+
+static void release_nodes_locked(sbuffer_t* buffer);
+
+static bool in_shard(const sbuffer_consumer_t* consumer, const sensor_data_t* data) {
+    return consumer->shards == 1 || data->id % consumer->shards == consumer->shard;
+}
+
+// Copies up to 'max' nodes of the consumer's shard into 'out', and moves it past the nodes of other shards too.
+// With max == 0 it only moves up to its next node. Must be called with buffer->mutex held.
+static size_t take_locked(sbuffer_consumer_t* consumer, sensor_data_t* out, size_t max) {
+    size_t count = 0;
+    while (consumer->next != NULL) {
+        sbuffer_node_t* node = consumer->next;
+        if (in_shard(consumer, &node->data)) {
+            if (count == max)
+                break;
+            out[count++] = node->data;
+        }
+        // the last consumer to pass a node frees it
+        consumer->taken = node->id + 1;
+        consumer->next = node->prev;
+        node->pending--;
+    }
+    return count;
+}
+
+void sbuffer_unregister_consumer(sbuffer_consumer_t* consumer) {
+    assert(consumer);
+    sbuffer_t* buffer = consumer->buffer;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+    // everything this consumer didn't take yet no longer waits for it
+    for (sbuffer_node_t* node = consumer->next; node != NULL; node = node->prev)
+        node->pending--;
+    release_nodes_locked(buffer);
+
+    sbuffer_consumer_t** link = &buffer->consumers;
+    while (*link != consumer)
+        link = &(*link)->nextConsumer;
+    *link = consumer->nextConsumer;
+    buffer->consumerCount--;
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+
+    ASSERT_ELSE_PERROR(pthread_cond_destroy(&consumer->dataAvailable) == 0);
+    free(consumer);
+}
+
 // ----------------------------- CLOSE BUFFER --------------------------------------
 
 void sbuffer_close(sbuffer_t* buffer) {
     ASSERT_ELSE_PERROR(pthread_rwlock_wrlock(&buffer->rwlock) == 0);
     assert(buffer);
+    // 'closed' is also read under the mutex, by the waiting threads
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
     buffer->closed = true;
+    // wake up everyone who is waiting, they won't get anything new
+    for (sbuffer_consumer_t* consumer = buffer->consumers; consumer != NULL; consumer = consumer->nextConsumer)
+        ASSERT_ELSE_PERROR(pthread_cond_broadcast(&consumer->dataAvailable) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_broadcast(&buffer->spaceAvailable) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
     ASSERT_ELSE_PERROR(pthread_rwlock_unlock(&buffer->rwlock) == 0);
 }
 
@@ -91,15 +226,28 @@ void sbuffer_destroy(sbuffer_t* buffer) {
     assert(buffer);
     // make sure it's empty
     assert(buffer->head == buffer->tail);
+    if (buffer->wal != NULL) {
+        sbuffer_wal_release(buffer->wal, buffer->toStore->taken);
+        sbuffer_wal_close(buffer->wal);
+    }
+    while (buffer->consumers != NULL) {
+        sbuffer_consumer_t* consumer = buffer->consumers;
+        buffer->consumers = consumer->nextConsumer;
+        ASSERT_ELSE_PERROR(pthread_cond_destroy(&consumer->dataAvailable) == 0);
+        free(consumer);
+    }
     ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->mutex) == 0);
     ASSERT_ELSE_PERROR(pthread_rwlock_destroy(&buffer->rwlock) == 0);
-    ASSERT_ELSE_PERROR(pthread_cond_destroy(&buffer->new_Data_Available_Low_Priority) == 0);
-    ASSERT_ELSE_PERROR(pthread_cond_destroy(&buffer->new_Data_Available_High_Priority) == 0);
-    ASSERT_ELSE_PERROR(pthread_cond_destroy(&buffer->dataToRemove) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_destroy(&buffer->spaceAvailable) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->reserveLock) == 0);
+    free(buffer->reserved);
+    free(buffer->reservedNodes);
+    if (buffer->spill != NULL)
+        sbuffer_spill_close(buffer->spill);
     free(buffer);
 }
 
-void node_destroy(sbuffer_node_t* node) {
+static void node_destroy(sbuffer_node_t* node) {
     assert(node);    
     free(node);
 }
@@ -109,7 +257,7 @@ bool sbuffer_is_empty(sbuffer_t* buffer) {
     // use mutex instead of read lock to avoid data race condition
     ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
     assert(buffer);
-    bool isEmpty = buffer->head == NULL;
+    bool isEmpty = buffer->head == NULL && (buffer->spill == NULL || sbuffer_spill_size(buffer->spill) == 0);
     ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
     return isEmpty;
 }
@@ -122,61 +270,68 @@ bool sbuffer_is_closed(sbuffer_t* buffer) {
     return isClosed;
 }
 
-bool sbuffer_has_data_to_store(sbuffer_t* buffer) {
-    // create a time value, SHUTDOWN_DELAY seconds from now
-    struct timespec timeValue;
-    clock_gettime(CLOCK_REALTIME, &timeValue);
-    timeValue.tv_sec += SHUTDOWN_DELAY;
-
-    assert(buffer);
-    bool hasDataToStore = false;
+bool sbuffer_has_data(sbuffer_consumer_t* consumer) {
+    assert(consumer);
+    sbuffer_t* buffer = consumer->buffer;
+    bool hasData = false;
     ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    hasDataToStore = buffer->toStore != NULL;
-    if (!hasDataToStore) {
-        printf("nothing to store, wait\n");
-        int errorValue = pthread_cond_timedwait(&buffer->new_Data_Available_Low_Priority, &buffer->mutex, &timeValue);
-        ASSERT_ELSE_PERROR((errorValue == 0) || (errorValue == ETIMEDOUT));
-        printf("check data to store\n");
-        hasDataToStore = buffer->toStore != NULL;
+    take_locked(consumer, NULL, 0);
+    release_nodes_locked(buffer);
+    hasData = consumer->next != NULL;
+    // a shard consumer may be woken up for nodes of other shards only
+    while (!hasData && !buffer->closed) {
+        consumer->waiting++;
+        ASSERT_ELSE_PERROR(pthread_cond_wait(&consumer->dataAvailable, &buffer->mutex) == 0);
+        consumer->waiting--;
+        take_locked(consumer, NULL, 0);
+        release_nodes_locked(buffer);
+        hasData = consumer->next != NULL;
     }
     ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-
-    return hasDataToStore; 
+    return hasData;
 }
 
 bool sbuffer_has_data_to_process(sbuffer_t* buffer) {
-    // create a time value, SHUTDOWN_DELAY seconds from now
-    struct timespec timeValue;
-    clock_gettime(CLOCK_REALTIME, &timeValue);
-    timeValue.tv_sec += SHUTDOWN_DELAY;
+    assert(buffer);
+    return sbuffer_has_data(buffer->toProcess[0]);
+}
 
+bool sbuffer_has_data_to_store(sbuffer_t* buffer) {
+    assert(buffer);
+    return sbuffer_has_data(buffer->toStore);
+}
+
+sbuffer_stats_t sbuffer_get_stats(sbuffer_t* buffer) {
     assert(buffer);
-    bool hasDataToProcess = false;
     ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    hasDataToProcess = buffer->toProcess != NULL;
-    if (!hasDataToProcess) {
-        printf("nothing to process, wait\n");
-        int errorValue = pthread_cond_timedwait(&buffer->new_Data_Available_High_Priority, &buffer->mutex, &timeValue);
-        ASSERT_ELSE_PERROR((errorValue == 0) || (errorValue == ETIMEDOUT));
-        printf("check data to process\n");
-        hasDataToProcess = buffer->toProcess != NULL;
-    }
+    sbuffer_stats_t stats = buffer->stats;
     ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return hasDataToProcess;
-
+    return stats;
 }
 
 // ------------------------------ INSERTING -----------------------------------------
 
-int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    assert(buffer && data);
-    if (buffer->closed)
-        return SBUFFER_FAILURE;
-    
-    // create new node
-    sbuffer_node_t* node = create_node(data);
+// Frees the tail node, whether or not every consumer took it. Must be called with buffer->mutex held.
+static void drop_oldest_locked(sbuffer_t* buffer) {
+    sbuffer_node_t* node = buffer->tail;
+    assert(node != NULL);
+    for (sbuffer_consumer_t* consumer = buffer->consumers; consumer != NULL; consumer = consumer->nextConsumer) {
+        if (consumer->next == node)
+            consumer->next = node->prev;
+    }
+    if (buffer->head == node)
+        buffer->head = NULL;
+    buffer->tail = node->prev;
+    buffer->count--;
+    buffer->stats.dropped++;
+    node_destroy(node);
+}
+
+// Appends 'node' at the head, as the next id. Must be called with buffer->mutex held.
+static void insert_node_locked(sbuffer_t* buffer, sbuffer_node_t* node) {
     assert(node->prev == NULL);
+    node->id = buffer->nextId++;
+    node->pending = buffer->consumerCount;
 
     // insert it
     if (buffer->head != NULL)
@@ -184,133 +339,286 @@ int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data) {
     buffer->head = node;
     if (buffer->tail == NULL)
         buffer->tail = node;
+    buffer->count++;
+    if (!buffer->aboveHighWatermark && buffer->config.high_watermark != 0 && buffer->count >= buffer->config.high_watermark) {
+        buffer->aboveHighWatermark = true;
+        buffer->config.on_watermark(buffer->config.watermark_arg, true);
+    }
 
-    if (buffer->toProcess == NULL)
-        buffer->toProcess = node;
-    
-    if (buffer->toStore == NULL)
-        buffer->toStore = node;
-    
-    printf("insert node id: %d\n", node->id);
-    // Wake up all waiting high priority readers
-    ASSERT_ELSE_PERROR(pthread_cond_broadcast(&buffer->new_Data_Available_High_Priority) == 0); 
-    // Wake up all waiting low priority readers
-    ASSERT_ELSE_PERROR(pthread_cond_broadcast(&buffer->new_Data_Available_Low_Priority) == 0); 
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+    for (sbuffer_consumer_t* consumer = buffer->consumers; consumer != NULL; consumer = consumer->nextConsumer) {
+        if (consumer->next == NULL) {
+            consumer->next = node;
+            // Wake up this reader if it is waiting
+            if (consumer->waiting > 0)
+                ASSERT_ELSE_PERROR(pthread_cond_broadcast(&consumer->dataAvailable) == 0);
+        }
+    }
+}
+
+// Moves spilled readings back into the list, up to 'spillThreshold' nodes. Must be called with buffer->mutex held.
+static void refill_from_spill_locked(sbuffer_t* buffer) {
+    if (buffer->spill == NULL)
+        return;
+    sensor_data_t refill[64];
+    while (buffer->count < buffer->spillThreshold && sbuffer_spill_size(buffer->spill) > 0) {
+        size_t room = buffer->spillThreshold - buffer->count;
+        size_t n = sbuffer_spill_read(buffer->spill, refill, room < 64 ? room : 64);
+        for (size_t i = 0; i < n; i++)
+            insert_node_locked(buffer, create_node(&refill[i]));
+    }
+}
+
+// Logs 'data' under id 'id', unless it is being replayed from the log. Must be called with buffer->mutex held.
+static bool log_locked(sbuffer_t* buffer, size_t id, sensor_data_t const* data, bool replaying) {
+    return buffer->wal == NULL || replaying || sbuffer_wal_append(buffer->wal, id, data);
+}
+
+// Inserts '*node' (or spills its reading), and sets '*node' to NULL if the buffer took it over.
+// Replayed readings were accepted before, so they always wait for room instead of applying the policy.
+static int insert_locked(sbuffer_t* buffer, sbuffer_node_t** node, bool replaying) {
+    if (buffer->closed)
+        return SBUFFER_FAILURE;
+
+    // once something is spilled, everything after it is spilled too, to keep the order
+    refill_from_spill_locked(buffer);
+    if (buffer->spill != NULL && (buffer->count >= buffer->spillThreshold || sbuffer_spill_size(buffer->spill) > 0)) {
+        size_t spilled = sbuffer_spill_size(buffer->spill);
+        if (!log_locked(buffer, buffer->nextId + spilled, &(*node)->data, replaying))
+            return SBUFFER_FAILURE;
+        if (sbuffer_spill_append(buffer->spill, &(*node)->data)) {
+            buffer->stats.spilled++;
+            return SBUFFER_SUCCESS;
+        }
+        if (spilled > 0) {
+            // the disk is full, and this reading can't overtake the spilled ones
+            buffer->stats.rejected++;
+            return SBUFFER_FULL;
+        }
+        // fall back on the overflow policy
+    }
+
+    // make room according to the overflow policy
+    size_t capacity = buffer->config.capacity;
+    if (capacity != 0 && buffer->count >= capacity) {
+        switch (replaying ? SBUFFER_BLOCK : buffer->config.policy) {
+        case SBUFFER_BLOCK:
+            buffer->insertWaiters++;
+            while (buffer->count >= capacity && !buffer->closed)
+                ASSERT_ELSE_PERROR(pthread_cond_wait(&buffer->spaceAvailable, &buffer->mutex) == 0);
+            buffer->insertWaiters--;
+            if (buffer->closed)
+                return SBUFFER_FAILURE;
+            break;
+        case SBUFFER_DROP_OLDEST:
+            drop_oldest_locked(buffer);
+            break;
+        case SBUFFER_REJECT_NEWEST:
+            buffer->stats.rejected++;
+            return SBUFFER_FULL;
+        }
+    }
+
+    if (!log_locked(buffer, buffer->nextId, &(*node)->data, replaying))
+        return SBUFFER_FAILURE;
+    insert_node_locked(buffer, *node);
+    *node = NULL;
     return SBUFFER_SUCCESS;
 }
-// -------------------------------- REMOVING ---------------------------------------
 
-void sbuffer_remove_node(sbuffer_t* buffer)
-{
+// The node is allocated before, and freed after, taking the mutex the consumers contend on.
+static int insert(sbuffer_t* buffer, sensor_data_t const* data, bool replaying) {
+    assert(buffer && data);
+    sbuffer_node_t* node = create_node(data);
     ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    sbuffer_node_t* remove_node = buffer->tail;
-    if (    (buffer->tail != NULL)
-        &&  (buffer->tail->isProcessed && buffer->tail->isStored))
-    {
-        if (buffer->tail == buffer->head) {
-            buffer->head = NULL;
+    int result = insert_locked(buffer, &node, replaying);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+    free(node);
+    return result;
+}
+
+int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data) {
+    return insert(buffer, data, false);
+}
+
+size_t sbuffer_reserve(sbuffer_t* buffer, size_t max, sensor_data_t** slots) {
+    assert(buffer && slots);
+    if (max == 0)
+        return 0;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->reserveLock) == 0);
+    if (max > buffer->reservedCapacity) {
+        buffer->reserved = realloc(buffer->reserved, max * sizeof(*buffer->reserved));
+        buffer->reservedNodes = realloc(buffer->reservedNodes, max * sizeof(*buffer->reservedNodes));
+        assert(buffer->reserved != NULL && buffer->reservedNodes != NULL);
+        buffer->reservedCapacity = max;
+    }
+    buffer->reservedCount = max;
+    *slots = buffer->reserved;
+    return max;
+}
+
+// Inserts the committed readings under one lock, each one as sbuffer_insert_first would.
+int sbuffer_commit(sbuffer_t* buffer, size_t n) {
+    assert(buffer && buffer->reservedCount > 0 && n <= buffer->reservedCount);
+    sbuffer_node_t** nodes = buffer->reservedNodes;
+    for (size_t i = 0; i < n; i++)
+        nodes[i] = create_node(&buffer->reserved[i]);
+    int result = SBUFFER_SUCCESS;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
+    for (size_t i = 0; i < n; i++) {
+        int inserting = insert_locked(buffer, &nodes[i], false);
+        if (inserting == SBUFFER_FAILURE || (inserting == SBUFFER_FULL && result == SBUFFER_SUCCESS))
+            result = inserting;
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
+    // the nodes the buffer didn't take
+    for (size_t i = 0; i < n; i++)
+        free(nodes[i]);
+    buffer->reservedCount = 0;
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->reserveLock) == 0);
+    return result;
+}
+
+void sbuffer_sync(sbuffer_t* buffer) {
+    assert(buffer);
+    if (buffer->wal != NULL)
+        sbuffer_wal_sync(buffer->wal);
+}
+
+size_t sbuffer_replay_wal(sbuffer_t* buffer) {
+    assert(buffer);
+    if (buffer->wal == NULL)
+        return 0;
+    size_t end = sbuffer_wal_end(buffer->wal);
+    size_t replayed = 0;
+    sensor_data_t chunk[64];
+    for (size_t id = sbuffer_wal_start(buffer->wal); id < end;) {
+        size_t n = sbuffer_wal_read(buffer->wal, id, chunk, 64);
+        ASSERT_ELSE_PERROR(n > 0);
+        for (size_t i = 0; i < n && id < end; i++, id++) {
+            if (insert(buffer, &chunk[i], true) == SBUFFER_SUCCESS)
+                replayed++;
         }
-        buffer->tail = remove_node->prev;
-        printf("node id = %d - temperature = %g - WILL BE REMOVED\n", remove_node->id, remove_node->data.value);        
-        node_destroy(remove_node);     
     }
-    else {
-        printf("buffer->tail = %p\n", buffer->tail);
+    return replayed;
+}
+// -------------------------------- REMOVING ---------------------------------------
+
+// Frees the nodes at the tail that every consumer has taken.
+// Consumers take nodes in order, so these always form a run starting at the tail.
+// Must be called with buffer->mutex held.
+static void release_nodes_locked(sbuffer_t* buffer) {
+    size_t released = 0;
+    while (buffer->tail != NULL && buffer->tail->pending == 0) {
+        sbuffer_node_t* node = buffer->tail;
+        if (buffer->head == node)
+            buffer->head = NULL;
+        buffer->tail = node->prev;
+        node_destroy(node);
+        released++;
     }
+    if (released == 0)
+        return;
+
+    buffer->count -= released;
 
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0); 
+    // move spilled readings back into the freed places
+    refill_from_spill_locked(buffer);
+
+    if (buffer->insertWaiters > 0)
+        ASSERT_ELSE_PERROR(pthread_cond_broadcast(&buffer->spaceAvailable) == 0);
+    if (buffer->aboveHighWatermark && buffer->count <= buffer->config.low_watermark) {
+        buffer->aboveHighWatermark = false;
+        buffer->config.on_watermark(buffer->config.watermark_arg, false);
+    }
 }
 
 // ---------------------------------- GETTERS -----------------------------------------
 
-sensor_data_t sbuffer_get_last_to_process(sbuffer_t* buffer) {    
+sensor_data_t sbuffer_get_next(sbuffer_consumer_t* consumer) {
+    assert(consumer);
+    sbuffer_t* buffer = consumer->buffer;
     ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    sbuffer_node_t* previous_node = NULL;
-    bool removeNode = false;
-
-    assert(buffer);
     assert(buffer->head != NULL);
     assert(buffer->tail != NULL);    
-    assert(buffer->toProcess != NULL);
-    
-    sensor_data_t ret = buffer->toProcess->data;
-    
-    printf("id to process: %d\n", buffer->toProcess->id);
-    
-    // indicate the node as processed
-    buffer->toProcess->isProcessed = true;
-    previous_node = buffer->toProcess->prev;
-
-    // check if this node was already stored,
-    // and remove it, if needed
-    removeNode = buffer->toProcess->isStored;
-    
-    // move the 'toProcess' pointer
-    buffer->toProcess = previous_node;
+    assert(consumer->next != NULL);
+
+    // everything the storagemgr took before has been stored
+    if (buffer->wal != NULL && consumer == buffer->toStore)
+        sbuffer_wal_release(buffer->wal, consumer->taken);
+
+    sensor_data_t ret;
+    size_t count = take_locked(consumer, &ret, 1);
+    assert(count == 1);
+    release_nodes_locked(buffer);
     ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
 
-    if (removeNode)
-    {
-       ASSERT_ELSE_PERROR(pthread_cond_broadcast(&buffer->dataToRemove) == 0);
-    }
-    
     return ret;
 }
 
+sensor_data_t sbuffer_get_last_to_process(sbuffer_t* buffer) {    
+    assert(buffer);
+    return sbuffer_get_next(buffer->toProcess[0]);
+}
+
 sensor_data_t sbuffer_get_last_to_store(sbuffer_t* buffer) {
-    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    sbuffer_node_t* previous_node = NULL;
-    bool removeNode = false;
     assert(buffer);
-    assert(buffer->head != NULL);
-    assert(buffer->tail != NULL);    
-    assert(buffer->toStore != NULL);
-    
-    sensor_data_t ret = buffer->toStore->data;
-    
-    printf("id to store: %d\n", buffer->toStore->id);    
-    
-    // indicate this node as stored
-    buffer->toStore->isStored = true;
-    previous_node= buffer->toStore->prev;
-
-    // check if this node was already processed,
-    // and remove it, if needed
-    removeNode = buffer->toStore->isProcessed;
-      
-    // move the 'toStore' pointer
-    buffer->toStore = previous_node;
-    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0); 
-
-    if (removeNode)
-    {
-       ASSERT_ELSE_PERROR(pthread_cond_broadcast(&buffer->dataToRemove) == 0);
-    }
-    
-    return ret;
+    return sbuffer_get_next(buffer->toStore);
 }
 
-bool sbuffer_has_data_to_remove(sbuffer_t* buffer)
-{
-    // create a time value, SHUTDOWN_DELAY seconds from now
+// ------------------------------- BATCH GETTERS ----------------------------------------
+
+// timeout_ms milliseconds from now, in the CLOCK_REALTIME base pthread_cond_timedwait expects
+static struct timespec deadline_after(int timeout_ms) {
     struct timespec timeValue;
     clock_gettime(CLOCK_REALTIME, &timeValue);
-    timeValue.tv_sec += SHUTDOWN_DELAY;
+    timeValue.tv_sec += timeout_ms / 1000;
+    timeValue.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (timeValue.tv_nsec >= 1000000000) {
+        timeValue.tv_sec++;
+        timeValue.tv_nsec -= 1000000000;
+    }
+    return timeValue;
+}
 
-    assert(buffer);
-    bool hasDataToRemove = false;
+size_t sbuffer_take_batch(sbuffer_consumer_t* consumer, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(consumer && out);
+    sbuffer_t* buffer = consumer->buffer;
     ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->mutex) == 0);
-    hasDataToRemove = (buffer->tail != NULL) && buffer->tail->isProcessed && buffer->tail->isStored;
-    if (!hasDataToRemove) {
-        printf("nothing to remove, wait\n");
-        int errorValue = pthread_cond_timedwait(&buffer->dataToRemove, &buffer->mutex, &timeValue);
-        ASSERT_ELSE_PERROR((errorValue == 0) || (errorValue == ETIMEDOUT));
-        printf("check data to remove\n");
-        hasDataToRemove = (buffer->tail != NULL) && buffer->tail->isProcessed && buffer->tail->isStored;
+    // everything the storagemgr took before has been stored
+    if (buffer->wal != NULL && consumer == buffer->toStore)
+        sbuffer_wal_release(buffer->wal, consumer->taken);
+
+    size_t count = take_locked(consumer, out, max);
+    release_nodes_locked(buffer);
+    if (count == 0 && timeout_ms != 0) {
+        struct timespec timeValue = deadline_after(timeout_ms);
+        int errorValue = 0;
+        // a shard consumer may be woken up for nodes of other shards only
+        while (count == 0 && errorValue != ETIMEDOUT && !buffer->closed) {
+            consumer->waiting++;
+            errorValue = timeout_ms < 0 ? pthread_cond_wait(&consumer->dataAvailable, &buffer->mutex)
+                                        : pthread_cond_timedwait(&consumer->dataAvailable, &buffer->mutex, &timeValue);
+            consumer->waiting--;
+            ASSERT_ELSE_PERROR((errorValue == 0) || (errorValue == ETIMEDOUT));
+            count = take_locked(consumer, out, max);
+            release_nodes_locked(buffer);
+        }
     }
     ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->mutex) == 0);
-    return hasDataToRemove;
+    return count;
+}
+
+size_t sbuffer_take_batch_to_process(sbuffer_t* buffer, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(buffer);
+    return sbuffer_take_batch(buffer->toProcess[0], out, max, timeout_ms);
 }
 
+size_t sbuffer_take_batch_to_process_shard(sbuffer_t* buffer, int shard, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(buffer && shard >= 0 && shard < buffer->processShards);
+    return sbuffer_take_batch(buffer->toProcess[shard], out, max, timeout_ms);
+}
 
+size_t sbuffer_take_batch_to_store(sbuffer_t* buffer, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(buffer);
+    return sbuffer_take_batch(buffer->toStore, out, max, timeout_ms);
+}
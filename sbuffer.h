@@ -2,6 +2,12 @@
 
 /**
  * \author Mathieu Erbas
+ *
+ * There are two implementations of this API, selected at configure time with
+ * -DSBUFFER_ENGINE=list|ring:
+ *  - sbuffer.c: a linked list with one malloc'd node per reading
+ *  - sbuffer_ring.c: a preallocated ring of SBUFFER_RING_CAPACITY slots,
+ *    with a sequence cursor per consumer and lock-free fast paths
  */
 
 #ifndef _GNU_SOURCE
@@ -10,17 +16,84 @@
 
 #include "config.h"
 #include <errno.h>
+#include <stddef.h>
 
 #define SBUFFER_FAILURE -1
 #define SBUFFER_SUCCESS 0
+#define SBUFFER_FULL 1 // the buffer is full and the measurement was rejected (SBUFFER_REJECT_NEWEST)
+
+// max number of 'to process' shards
+#define SBUFFER_MAX_SHARDS 32
 
 typedef struct sbuffer sbuffer_t;
 typedef struct sbuffer_node sbuffer_node_t;
+typedef struct sbuffer_consumer sbuffer_consumer_t;
+
+/**
+ * What sbuffer_insert_first does when the buffer holds 'capacity' measurements
+ */
+typedef enum {
+    SBUFFER_BLOCK,         // wait until the slowest consumer frees a place
+    SBUFFER_DROP_OLDEST,   // drop the oldest measurement, even if not every consumer took it yet
+    SBUFFER_REJECT_NEWEST, // don't insert the new measurement and return SBUFFER_FULL
+} sbuffer_overflow_policy_t;
+
+/**
+ * Who calls sbuffer_insert_first
+ */
+typedef enum {
+    SBUFFER_SINGLE_PRODUCER, // only one thread at a time (the connmgr), which allows a wait-free publish
+    SBUFFER_MULTI_PRODUCER,  // any number of threads concurrently
+} sbuffer_producer_mode_t;
+
+/**
+ * Called with high == true when the number of buffered measurements reaches the high watermark,
+ * and with high == false when it drops back to the low watermark.
+ * It runs on the inserting or consuming thread, possibly with internal locks held,
+ * so it should only flip a flag and must not call back into the buffer.
+ */
+typedef void (*sbuffer_watermark_callback_t)(void* arg, bool high);
+
+typedef struct {
+    size_t capacity; /**< max number of buffered measurements, 0 for the engine's default (unbounded for the list engine) */
+    sbuffer_overflow_policy_t policy;
+    size_t high_watermark; /**< 0 disables the watermark callback */
+    size_t low_watermark;
+    sbuffer_watermark_callback_t on_watermark;
+    void* watermark_arg;
+    const char* spill_dir;  /**< if set, measurements past 'spill_threshold' go to segment files in this directory */
+    size_t spill_threshold; /**< number of measurements kept in memory before spilling, 0 for 'capacity' (an unbounded buffer then never spills) */
+    const char* wal_dir;    /**< if set, measurements are logged in this directory until the storagemgr took them */
+    int wal_sync_ms;        /**< longest time between two fsyncs of the log, 0 for SBUFFER_WAL_SYNC_MS */
+    int process_shards;     /**< number of 'to process' consumers that split the measurements by sensor id, 0 for 1 */
+    sbuffer_producer_mode_t producers; /**< SBUFFER_MULTI_PRODUCER if several threads insert measurements */
+} sbuffer_config_t;
+
+typedef struct {
+    size_t dropped;  /**< measurements dropped by SBUFFER_DROP_OLDEST */
+    size_t rejected; /**< measurements rejected by SBUFFER_REJECT_NEWEST */
+    size_t spilled;  /**< measurements that went through the spill files */
+} sbuffer_stats_t;
 
 /**
  * Allocate and initialize a new shared buffer
+ * The buffer starts out with registered consumers for the datamgr ('to process', one per shard)
+ * and the storagemgr ('to store')
+ * \param config the capacity and overflow policy to use, or NULL for the engine's default capacity and SBUFFER_BLOCK
+ */
+sbuffer_t* sbuffer_create(const sbuffer_config_t* config);
+
+/**
+ * Inserts the measurements the write-ahead log holds from a previous run, that weren't stored yet
+ * Must be called after the consumers are running, and before the first sbuffer_insert_first.
+ * \return the number of measurements inserted, 0 if the buffer has no 'wal_dir'
+ */
+size_t sbuffer_replay_wal(sbuffer_t* buffer);
+
+/**
+ * Returns the number of measurements the buffer dropped or rejected so far
  */
-sbuffer_t* sbuffer_create();
+sbuffer_stats_t sbuffer_get_stats(sbuffer_t* buffer);
 
 /**
  * Clean up & free all allocated resources
@@ -31,13 +104,52 @@ bool sbuffer_is_empty(sbuffer_t* buffer);
 
 bool sbuffer_is_closed(sbuffer_t* buffer);
 
+/**
+ * Registers an extra consumer on 'buffer', with its own cursor and its own wait primitive
+ * The consumer sees every measurement inserted after it was registered,
+ * and those measurements are only released once all registered consumers have taken them
+ * \return the new consumer, or NULL if no more consumers can be registered
+ */
+sbuffer_consumer_t* sbuffer_register_consumer(sbuffer_t* buffer);
+
+/**
+ * Registers a consumer that only takes the measurements of sensors with id % 'shards' == 'shard'
+ * The measurements of other sensors count as taken as soon as it moves past them,
+ * so every sensor's measurements still reach it in order.
+ * \return the new consumer, or NULL if no more consumers can be registered
+ */
+sbuffer_consumer_t* sbuffer_register_shard_consumer(sbuffer_t* buffer, int shard, int shards);
+
+/**
+ * Unregisters 'consumer' and frees it. Measurements it didn't take yet no longer wait for it.
+ */
+void sbuffer_unregister_consumer(sbuffer_consumer_t* consumer);
+
+/**
+ * Waits until there is data for 'consumer', or until the buffer is closed
+ * \return true if there is data that 'consumer' hasn't taken yet (and that is in its shard)
+ */
+bool sbuffer_has_data(sbuffer_consumer_t* consumer);
+
+/**
+ * Returns the oldest measurement that 'consumer' hasn't taken yet, and moves its cursor past it
+ * \return the measurement
+ */
+sensor_data_t sbuffer_get_next(sbuffer_consumer_t* consumer);
+
+/**
+ * Waits until there is data for 'consumer', then takes up to 'max' measurements (oldest first) in one go
+ * \param out an array of at least 'max' elements, that will be filled out with the measurements
+ * \param timeout_ms how long to wait for data, in milliseconds; 0 doesn't wait, a negative value waits until
+ *                   there is data or the buffer is closed
+ * \return the number of measurements copied into 'out', 0 if the timeout expired or the buffer is closed
+ */
+size_t sbuffer_take_batch(sbuffer_consumer_t* consumer, sensor_data_t* out, size_t max, int timeout_ms);
+
 bool sbuffer_has_data_to_process(sbuffer_t* buffer);
 
 bool sbuffer_has_data_to_store(sbuffer_t* buffer);
 
-//void sbuffer_remove_node(sbuffer_t* buffer, sbuffer_node_t* remove_node);
-void sbuffer_remove_node(sbuffer_t* buffer);
-
 /*
     Gain/release exclusive access to the buffer
     TODO: these functions should not exist!
@@ -51,11 +163,43 @@ void sbuffer_remove_node(sbuffer_t* buffer);
 /**
  * Inserts the sensor data in 'data' at the start of 'buffer' (at the 'head')
  * \param buffer a pointer to the buffer that is used
+ * If the buffer is full, the measurement is spilled to disk if a spill_dir is configured,
+ * otherwise (or if spilling fails) the configured sbuffer_overflow_policy_t decides what happens
  * \param data a pointer to sensor_data_t data, that will be _copied_ into the buffer
- * \return the current status of the buffer
+ * Unless the buffer was created with SBUFFER_MULTI_PRODUCER, only one thread may call this at a time.
+ * \return SBUFFER_SUCCESS, SBUFFER_FULL if the measurement was rejected,
+ *         or SBUFFER_FAILURE if the buffer is closed or the measurement couldn't be logged
  */
 int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data);
 
+/**
+ * Reserves up to 'max' consecutive measurements at the start of 'buffer', for the caller to write in place
+ * They stay invisible to the consumers until sbuffer_commit, which must follow before anything else is inserted
+ * by this thread. Meanwhile, the calling thread is the only one that can insert.
+ * The ring engine hands out its own free slots, so it may reserve fewer than 'max'. It reserves nothing
+ * when the buffer is closed, or when it has no room and sbuffer_insert_first would have to apply the overflow
+ * policy or spill, which is what the caller should fall back on. With SBUFFER_BLOCK, it waits for room first.
+ * The list engine reserves 'max' measurements in a staging area, which sbuffer_commit copies into new nodes.
+ * \param slots set to the first reserved measurement
+ * \return the number of measurements reserved
+ */
+size_t sbuffer_reserve(sbuffer_t* buffer, size_t max, sensor_data_t** slots);
+
+/**
+ * Inserts the first 'n' measurements of the reservation at once, and gives the rest of it back
+ * Must follow a sbuffer_reserve that reserved at least 'n' measurements (and at least one).
+ * \return SBUFFER_SUCCESS if every measurement was inserted, SBUFFER_FULL if some were rejected,
+ *         or SBUFFER_FAILURE if some were lost because the buffer is closed or they couldn't be logged
+ */
+int sbuffer_commit(sbuffer_t* buffer, size_t n);
+
+/**
+ * Waits until every measurement inserted so far is on disk in the write-ahead log, so a crash can't lose it
+ * Inserts and commits only write the log: a producer calls this once per batch of them, so they share an fsync.
+ * Returns right away if the buffer has no 'wal_dir'.
+ */
+void sbuffer_sync(sbuffer_t* buffer);
+
 /**
  * Removes & returns the last measurement in the buffer (at the 'tail')
  * \return the removed measurement
@@ -80,8 +224,33 @@ sensor_data_t sbuffer_get_last_to_process(sbuffer_t* buffer);
  */
 sensor_data_t sbuffer_get_last_to_store(sbuffer_t* buffer);
 
+/**
+ * Waits until there is data to process, then takes up to 'max' measurements (oldest first) in one go
+ * \param out an array of at least 'max' elements, that will be filled out with the measurements
+ * \param timeout_ms how long to wait for data, in milliseconds; 0 doesn't wait, a negative value waits forever
+ * \return the number of measurements copied into 'out', 0 if the timeout expired
+ */
+size_t sbuffer_take_batch_to_process(sbuffer_t* buffer, sensor_data_t* out, size_t max, int timeout_ms);
+
+/**
+ * Same as sbuffer_take_batch_to_process, for shard 'shard' of the 'process_shards' in the config
+ * sbuffer_take_batch_to_process, sbuffer_has_data_to_process and sbuffer_get_last_to_process use shard 0.
+ */
+size_t sbuffer_take_batch_to_process_shard(sbuffer_t* buffer, int shard, sensor_data_t* out, size_t max, int timeout_ms);
+
+/**
+ * Waits until there is data to store, then takes up to 'max' measurements (oldest first) in one go
+ * \param out an array of at least 'max' elements, that will be filled out with the measurements
+ * \param timeout_ms how long to wait for data, in milliseconds; 0 doesn't wait, a negative value waits forever
+ * \return the number of measurements copied into 'out', 0 if the timeout expired
+ */
+size_t sbuffer_take_batch_to_store(sbuffer_t* buffer, sensor_data_t* out, size_t max, int timeout_ms);
+
 /**
  * Closes the buffer. This signifies that no more data will be inserted.
+ * A measurement is freed by the last consumer to take it (there is no separate removal step),
+ * so the buffer becomes empty once every measurement has been both processed and stored.
+ * Threads waiting for data or for room are woken up right away: waiting consumers return
+ * what is left (or nothing), and a blocked sbuffer_insert_first returns SBUFFER_FAILURE.
  */
-void sbuffer_close(sbuffer_t* buffer);
-bool sbuffer_has_data_to_remove(sbuffer_t* buffer);
\ No newline at end of file
+void sbuffer_close(sbuffer_t* buffer);
\ No newline at end of file
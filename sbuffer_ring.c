@@ -0,0 +1,821 @@
+/**
+ * \author Mathieu Erbas
+ *
+ * Ring buffer implementation of the sbuffer API.
+ * All slots are preallocated up front, so inserting a reading never calls
+ * malloc/free. The connmgr owns the 'head' sequence and every registered
+ * consumer owns its own sequence cursor. Each cursor is written by exactly one
+ * thread, so the fast paths only need atomic loads/stores: the producer
+ * publishes a reading with a release store of 'head', which is wait-free.
+ * A thread that has nothing to do spins briefly and then parks on a futex,
+ * and the other side only makes a syscall when someone is parked.
+ * Mutexes are only taken off the fast paths:
+ *  - 'registry' to (un)register a consumer, to refresh the watermark, and to
+ *    push lagging cursors forward with SBUFFER_DROP_OLDEST,
+ *  - 'watermarkLock' in check_watermark, around the watermark callbacks,
+ *  - 'takeLock' by every take with SBUFFER_DROP_OLDEST,
+ *  - 'spillLock' by inserts and refills while the spill is in use,
+ *  - 'producerLock' by every insert and reservation with SBUFFER_MULTI_PRODUCER.
+ * With a write-ahead log, sbuffer_sync waits for the log's fsync without
+ * holding any of these.
+ * With SBUFFER_MULTI_PRODUCER, inserting threads take turns owning 'head'
+ * through 'producerLock', which consumers never take.
+ * sbuffer_reserve hands out free slots past 'head' for the producer to fill in
+ * place, and sbuffer_commit publishes them with one store of 'head'. A thread
+ * keeps owning 'head' from its reservation until its commit.
+ * A slot is free again once every registered consumer has passed it:
+ * the producer only looks at the oldest consumer cursor (the watermark) when
+ * the ring looks full.
+ * With SBUFFER_DROP_OLDEST the producer may push a lagging consumer's cursor
+ * forward, so in that mode every consumer copies its slots under its own
+ * (normally uncontended) 'takeLock'.
+ * With a spill directory, readings that arrive while 'spillThreshold' slots
+ * are in use go to the spill. While 'spilling' is set, the producer and the
+ * consumers that move spilled readings back into the ring all take
+ * 'spillLock' before writing slots or 'head'; only the producer sets
+ * 'spilling', so it can skip the lock when it sees the flag cleared.
+ * With a write-ahead log, a reading is logged under the sequence number of
+ * the slot it will get, once it is sure to get one.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "sbuffer.h"
+
+#include "config.h"
+#include "sbuffer_spill.h"
+#include "sbuffer_wal.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define SBUFFER_CACHE_LINE 64
+
+// capacity used when the config doesn't set one, other capacities are rounded up to a power of two
+#ifndef SBUFFER_RING_CAPACITY
+    #define SBUFFER_RING_CAPACITY 4096
+#endif
+
+// consumer slots are preallocated along with the ring, with room for every 'to process' shard
+#ifndef SBUFFER_MAX_CONSUMERS
+    #define SBUFFER_MAX_CONSUMERS (SBUFFER_MAX_SHARDS + 8)
+#endif
+
+// max number of times a thread re-checks before parking, 0 never spins (it is never done on a single core)
+#ifndef SBUFFER_SPIN_MAX
+    #define SBUFFER_SPIN_MAX 256
+#endif
+
+_Static_assert((SBUFFER_RING_CAPACITY & (SBUFFER_RING_CAPACITY - 1)) == 0, "SBUFFER_RING_CAPACITY must be a power of two");
+
+// a thread parks here when its cursor can't move
+typedef struct {
+    atomic_uint epoch;  // futex word, bumped by every wakeup
+    atomic_int waiters; // lets the other side skip the syscall when nobody is parked
+    atomic_uint spin;   // how long to spin before parking, adapted to how often spinning pays off
+    unsigned spinMax;
+} ring_waitq_t;
+
+struct sbuffer_consumer {
+    // every cursor gets its own cache line to avoid false sharing
+    alignas(SBUFFER_CACHE_LINE) atomic_size_t cursor; // next sequence to take
+    atomic_bool registered;
+    int shard; // only takes the readings of sensors with id % shards == shard
+    int shards;
+    sbuffer_t* buffer;
+    ring_waitq_t dataAvailable;
+    pthread_mutex_t takeLock; // only used with SBUFFER_DROP_OLDEST
+};
+
+struct sbuffer {
+    alignas(SBUFFER_CACHE_LINE) atomic_size_t head; // next sequence to insert
+    size_t watermark;                               // producer's cached copy of oldest_consumer_cursor()
+    size_t reserved;                                // number of slots past 'head' reserved by the producer
+    pthread_mutex_t producerLock;                   // only used with SBUFFER_MULTI_PRODUCER
+
+    alignas(SBUFFER_CACHE_LINE) sensor_data_t* slots;
+    size_t capacity; // always a power of two
+    sbuffer_config_t config;
+    atomic_bool closed;
+    ring_waitq_t spaceAvailable;
+    atomic_size_t dropped;
+    atomic_size_t rejected;
+
+    sbuffer_spill_t* spill;
+    size_t spillThreshold;
+    pthread_mutex_t spillLock;
+    atomic_bool spilling;
+    atomic_size_t spilled;
+
+    sbuffer_wal_t* wal;
+
+    // watermark transitions and their callbacks are serialized, so the callbacks can't be reordered
+    pthread_mutex_t watermarkLock;
+    atomic_bool aboveHighWatermark;
+
+    // (un)registering a consumer and refreshing the watermark are serialized,
+    // so a new consumer never starts on a slot the producer is about to overwrite
+    pthread_mutex_t registry;
+    atomic_int consumerSlots; // consumers[0, consumerSlots) have been used at some point
+    sbuffer_consumer_t consumers[SBUFFER_MAX_CONSUMERS];
+    sbuffer_consumer_t* toProcess[SBUFFER_MAX_SHARDS]; // the datamgr, one consumer per shard
+    int processShards;
+    sbuffer_consumer_t* toStore;   // the storagemgr
+};
+
+// -------------------------- WAIT QUEUES ----------------------------------------
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+// Sleeps while *word == expected, until woken up or the deadline passes (NULL sleeps until woken up).
+// Returns false if the deadline passed.
+static bool futex_wait(atomic_uint* word, unsigned expected, const struct timespec* deadline) {
+    // FUTEX_WAIT_BITSET takes an absolute deadline, in the CLOCK_REALTIME base deadline_after() uses
+    long ret = syscall(SYS_futex, (unsigned*) word, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME,
+                       expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    ASSERT_ELSE_PERROR(ret == 0 || errno == EAGAIN || errno == EINTR || errno == ETIMEDOUT);
+    return ret == 0 || errno != ETIMEDOUT;
+}
+
+static void futex_wake_all(atomic_uint* word) {
+    ASSERT_ELSE_PERROR(syscall(SYS_futex, (unsigned*) word, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, NULL, NULL, 0) >= 0);
+}
+
+static void waitq_init(ring_waitq_t* queue, unsigned spinMax) {
+    atomic_init(&queue->epoch, 0);
+    atomic_init(&queue->waiters, 0);
+    atomic_init(&queue->spin, spinMax);
+    queue->spinMax = spinMax;
+}
+
+// Wait until 'ready' holds or the deadline passes (NULL waits forever).
+// The waiter count is raised and the epoch read before 'ready' is re-checked,
+// and the waking side publishes its cursor before reading the count and bumping
+// the epoch, so a wakeup is never lost.
+static bool waitq_wait(ring_waitq_t* queue, bool (*ready)(void*), void* arg, const struct timespec* deadline) {
+    // at high rates the other side usually catches up before a futex round trip would be done
+    unsigned spin = atomic_load_explicit(&queue->spin, memory_order_relaxed);
+    for (unsigned i = 0; i < spin; i++) {
+        cpu_relax();
+        if (ready(arg)) {
+            // spinning paid off, allow a bit more next time
+            unsigned more = spin + spin / 4 + 1;
+            atomic_store_explicit(&queue->spin, more < queue->spinMax ? more : queue->spinMax, memory_order_relaxed);
+            return true;
+        }
+    }
+    // it didn't, spin less next time (but never stop trying entirely)
+    if (spin > queue->spinMax / 16)
+        atomic_store_explicit(&queue->spin, spin / 2, memory_order_relaxed);
+
+    atomic_fetch_add(&queue->waiters, 1);
+    bool isReady;
+    for (;;) {
+        unsigned epoch = atomic_load(&queue->epoch);
+        isReady = ready(arg);
+        if (isReady)
+            break;
+        if (!futex_wait(&queue->epoch, epoch, deadline)) {
+            isReady = ready(arg);
+            break;
+        }
+    }
+    atomic_fetch_sub(&queue->waiters, 1);
+    return isReady;
+}
+
+static void waitq_wake(ring_waitq_t* queue) {
+    if (atomic_load(&queue->waiters) == 0)
+        return;
+    atomic_fetch_add(&queue->epoch, 1);
+    futex_wake_all(&queue->epoch);
+}
+
+static void wake_consumers(sbuffer_t* buffer) {
+    int slots = atomic_load_explicit(&buffer->consumerSlots, memory_order_relaxed);
+    for (int i = 0; i < slots; i++)
+        waitq_wake(&buffer->consumers[i].dataAvailable);
+}
+
+// timeout_ms milliseconds from now, in the CLOCK_REALTIME base pthread_cond_timedwait expects
+static struct timespec deadline_after(int timeout_ms) {
+    struct timespec timeValue;
+    clock_gettime(CLOCK_REALTIME, &timeValue);
+    timeValue.tv_sec += timeout_ms / 1000;
+    timeValue.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (timeValue.tv_nsec >= 1000000000) {
+        timeValue.tv_sec++;
+        timeValue.tv_nsec -= 1000000000;
+    }
+    return timeValue;
+}
+
+// ------------------------------- PREDICATES (internal) ------------------------------
+
+// Must be called with buffer->registry held.
+static size_t oldest_consumer_cursor(sbuffer_t* buffer) {
+    size_t oldest = atomic_load(&buffer->head);
+    int slots = atomic_load(&buffer->consumerSlots);
+    for (int i = 0; i < slots; i++) {
+        sbuffer_consumer_t* consumer = &buffer->consumers[i];
+        if (!atomic_load(&consumer->registered))
+            continue;
+        size_t cursor = atomic_load(&consumer->cursor);
+        if (cursor < oldest)
+            oldest = cursor;
+    }
+    return oldest;
+}
+
+static size_t refresh_watermark(sbuffer_t* buffer) {
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->registry) == 0);
+    size_t oldest = oldest_consumer_cursor(buffer);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->registry) == 0);
+    return oldest;
+}
+
+static bool ready_to_take(void* arg) {
+    sbuffer_consumer_t* consumer = arg;
+    return atomic_load(&consumer->cursor) != atomic_load(&consumer->buffer->head);
+}
+
+// a closed buffer wakes up all waiting threads, they won't get anything new
+static bool ready_to_take_or_closed(void* arg) {
+    sbuffer_consumer_t* consumer = arg;
+    return ready_to_take(consumer) || atomic_load(&consumer->buffer->closed);
+}
+
+static bool ready_to_insert(void* arg) {
+    sbuffer_t* buffer = arg;
+    return atomic_load(&buffer->head) - refresh_watermark(buffer) < buffer->capacity || atomic_load(&buffer->closed);
+}
+
+// -------------------------- CREATION -------------------------------------------
+
+// Calls the watermark callback if the buffer crossed the high (high == true) or low watermark.
+static void check_watermark(sbuffer_t* buffer, bool high) {
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->watermarkLock) == 0);
+    if (atomic_load(&buffer->aboveHighWatermark) != high) {
+        size_t buffered = atomic_load(&buffer->head) - refresh_watermark(buffer);
+        if (high ? buffered >= buffer->config.high_watermark : buffered <= buffer->config.low_watermark) {
+            atomic_store(&buffer->aboveHighWatermark, high);
+            buffer->config.on_watermark(buffer->config.watermark_arg, high);
+        }
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->watermarkLock) == 0);
+}
+
+sbuffer_t* sbuffer_create(const sbuffer_config_t* config) {
+    sbuffer_t* buffer = aligned_alloc(SBUFFER_CACHE_LINE, sizeof(sbuffer_t));
+    assert(buffer != NULL);
+    buffer->config = config ? *config : (sbuffer_config_t){.policy = SBUFFER_BLOCK};
+    buffer->capacity = SBUFFER_RING_CAPACITY;
+    if (buffer->config.capacity != 0) {
+        buffer->capacity = 1;
+        while (buffer->capacity < buffer->config.capacity)
+            buffer->capacity <<= 1;
+    }
+    buffer->slots = aligned_alloc(SBUFFER_CACHE_LINE, buffer->capacity * sizeof(sensor_data_t));
+    assert(buffer->slots != NULL);
+
+    buffer->wal = NULL;
+    if (buffer->config.wal_dir != NULL) {
+        buffer->wal = sbuffer_wal_open(buffer->config.wal_dir, buffer->config.wal_sync_ms);
+        ASSERT_ELSE_PERROR(buffer->wal != NULL);
+    }
+    // the log decides where the sequence numbers continue
+    size_t start = buffer->wal ? sbuffer_wal_start(buffer->wal) : 0;
+    atomic_init(&buffer->head, start);
+    buffer->watermark = start;
+    buffer->reserved = 0;
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->producerLock, NULL) == 0);
+    atomic_init(&buffer->closed, false);
+    unsigned spinMax = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SBUFFER_SPIN_MAX : 0;
+    waitq_init(&buffer->spaceAvailable, spinMax);
+    atomic_init(&buffer->dropped, 0);
+    atomic_init(&buffer->rejected, 0);
+    buffer->spill = buffer->config.spill_dir ? sbuffer_spill_open(buffer->config.spill_dir) : NULL;
+    buffer->spillThreshold = buffer->capacity;
+    if (buffer->config.spill_threshold != 0 && buffer->config.spill_threshold < buffer->capacity)
+        buffer->spillThreshold = buffer->config.spill_threshold;
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->spillLock, NULL) == 0);
+    atomic_init(&buffer->spilling, false);
+    atomic_init(&buffer->spilled, 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->watermarkLock, NULL) == 0);
+    atomic_init(&buffer->aboveHighWatermark, false);
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&buffer->registry, NULL) == 0);
+    atomic_init(&buffer->consumerSlots, 0);
+    for (int i = 0; i < SBUFFER_MAX_CONSUMERS; i++) {
+        sbuffer_consumer_t* consumer = &buffer->consumers[i];
+        atomic_init(&consumer->cursor, 0);
+        atomic_init(&consumer->registered, false);
+        consumer->buffer = buffer;
+        waitq_init(&consumer->dataAvailable, spinMax);
+        ASSERT_ELSE_PERROR(pthread_mutex_init(&consumer->takeLock, NULL) == 0);
+    }
+
+    buffer->processShards = buffer->config.process_shards > 0 ? buffer->config.process_shards : 1;
+    assert(buffer->processShards <= SBUFFER_MAX_SHARDS);
+    for (int shard = 0; shard < buffer->processShards; shard++)
+        buffer->toProcess[shard] = sbuffer_register_shard_consumer(buffer, shard, buffer->processShards);
+    buffer->toStore = sbuffer_register_consumer(buffer);
+    return buffer;
+}
+
+sbuffer_stats_t sbuffer_get_stats(sbuffer_t* buffer) {
+    assert(buffer);
+    return (sbuffer_stats_t){
+        .dropped = atomic_load(&buffer->dropped),
+        .rejected = atomic_load(&buffer->rejected),
+        .spilled = atomic_load(&buffer->spilled),
+    };
+}
+
+// -------------------------- CONSUMERS -------------------------------------------
+
+sbuffer_consumer_t* sbuffer_register_consumer(sbuffer_t* buffer) {
+    return sbuffer_register_shard_consumer(buffer, 0, 1);
+}
+
+sbuffer_consumer_t* sbuffer_register_shard_consumer(sbuffer_t* buffer, int shard, int shards) {
+    assert(buffer && shards > 0 && shard >= 0 && shard < shards);
+    sbuffer_consumer_t* found = NULL;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->registry) == 0);
+    for (int i = 0; i < SBUFFER_MAX_CONSUMERS && found == NULL; i++) {
+        if (!atomic_load(&buffer->consumers[i].registered))
+            found = &buffer->consumers[i];
+    }
+    if (found != NULL) {
+        // start at the current head: only readings inserted from now on are for this consumer
+        atomic_store(&found->cursor, atomic_load(&buffer->head));
+        found->shard = shard;
+        found->shards = shards;
+        atomic_store(&found->registered, true);
+        int index = (int) (found - buffer->consumers);
+        if (index >= atomic_load(&buffer->consumerSlots))
+            atomic_store(&buffer->consumerSlots, index + 1);
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->registry) == 0);
+    return found;
+}
+
+void sbuffer_unregister_consumer(sbuffer_consumer_t* consumer) {
+    assert(consumer);
+    sbuffer_t* buffer = consumer->buffer;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->registry) == 0);
+    atomic_store(&consumer->registered, false);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->registry) == 0);
+    // the slots this consumer didn't take yet may be free now
+    waitq_wake(&buffer->spaceAvailable);
+}
+
+// ----------------------------- CLOSE BUFFER --------------------------------------
+
+void sbuffer_close(sbuffer_t* buffer) {
+    assert(buffer);
+    atomic_store(&buffer->closed, true);
+    // wake up everyone who is waiting, they won't get anything new
+    wake_consumers(buffer);
+    waitq_wake(&buffer->spaceAvailable);
+}
+
+// ------------------------------ DESTROYING ---------------------------------------
+
+void sbuffer_destroy(sbuffer_t* buffer) {
+    assert(buffer);
+    // make sure it's empty
+    assert(sbuffer_is_empty(buffer));
+    if (buffer->wal != NULL) {
+        sbuffer_wal_release(buffer->wal, atomic_load(&buffer->toStore->cursor));
+        sbuffer_wal_close(buffer->wal);
+    }
+    for (int i = 0; i < SBUFFER_MAX_CONSUMERS; i++)
+        ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->consumers[i].takeLock) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->watermarkLock) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->registry) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->spillLock) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&buffer->producerLock) == 0);
+    if (buffer->spill != NULL)
+        sbuffer_spill_close(buffer->spill);
+    free(buffer->slots);
+    free(buffer);
+}
+
+// ------------------------------- PREDICATES -----------------------------------------
+
+bool sbuffer_is_empty(sbuffer_t* buffer) {
+    assert(buffer);
+    return !atomic_load(&buffer->spilling) && refresh_watermark(buffer) == atomic_load(&buffer->head);
+}
+
+bool sbuffer_is_closed(sbuffer_t* buffer) {
+    assert(buffer);
+    return atomic_load(&buffer->closed);
+}
+
+static size_t take(sbuffer_consumer_t* consumer, sensor_data_t* out, size_t max, bool* hasOwn);
+
+// Moves a shard consumer past the readings of other shards.
+// Returns true if the consumer has a reading of its own to take.
+static bool skip_other_shards(sbuffer_consumer_t* consumer) {
+    if (consumer->shards == 1)
+        return ready_to_take(consumer);
+    bool hasOwn;
+    take(consumer, NULL, 0, &hasOwn);
+    return hasOwn;
+}
+
+bool sbuffer_has_data(sbuffer_consumer_t* consumer) {
+    assert(consumer);
+    // a shard consumer may be woken up for readings of other shards only
+    for (;;) {
+        // readings inserted before the buffer was closed are still taken
+        bool closed = atomic_load(&consumer->buffer->closed);
+        if (skip_other_shards(consumer))
+            return true;
+        if (closed)
+            return false;
+        waitq_wait(&consumer->dataAvailable, ready_to_take_or_closed, consumer, NULL);
+    }
+}
+
+bool sbuffer_has_data_to_process(sbuffer_t* buffer) {
+    assert(buffer);
+    return sbuffer_has_data(buffer->toProcess[0]);
+}
+
+bool sbuffer_has_data_to_store(sbuffer_t* buffer) {
+    assert(buffer);
+    return sbuffer_has_data(buffer->toStore);
+}
+
+// ------------------------------ INSERTING -----------------------------------------
+
+// Moves every consumer cursor that is still before 'oldest' up to 'oldest'.
+static void drop_before(sbuffer_t* buffer, size_t oldest) {
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->registry) == 0);
+    int slots = atomic_load(&buffer->consumerSlots);
+    for (int i = 0; i < slots; i++) {
+        sbuffer_consumer_t* consumer = &buffer->consumers[i];
+        if (!atomic_load(&consumer->registered) || atomic_load(&consumer->cursor) >= oldest)
+            continue;
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&consumer->takeLock) == 0);
+        if (atomic_load(&consumer->cursor) < oldest)
+            atomic_store(&consumer->cursor, oldest);
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&consumer->takeLock) == 0);
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->registry) == 0);
+}
+
+// Makes the slots up to 'head' (which must have been written) visible to the consumers.
+static void publish_up_to(sbuffer_t* buffer, size_t head) {
+    // pairs with the acquire load in take(), so the slots are written before a consumer reads them
+    atomic_store_explicit(&buffer->head, head, memory_order_release);
+
+    // the cached watermark overestimates how much is buffered, so only then check the real number
+    if (buffer->config.high_watermark != 0 && head - buffer->watermark >= buffer->config.high_watermark
+        && !atomic_load_explicit(&buffer->aboveHighWatermark, memory_order_relaxed)) {
+        buffer->watermark = refresh_watermark(buffer);
+        check_watermark(buffer, true);
+    }
+    // a release store may pass the waiter count loads, the fence keeps the wakeup from being lost
+    atomic_thread_fence(memory_order_seq_cst);
+    wake_consumers(buffer);
+}
+
+// Writes 'data' in slot 'seq' (which must be free) and makes it visible to the consumers.
+static void publish(sbuffer_t* buffer, size_t seq, sensor_data_t const* data) {
+    buffer->slots[seq & (buffer->capacity - 1)] = *data;
+    publish_up_to(buffer, seq + 1);
+}
+
+// Moves spilled readings into the ring, up to 'spillThreshold' used slots. Must be called with spillLock held.
+static void refill_locked(sbuffer_t* buffer) {
+    size_t head = atomic_load(&buffer->head);
+    size_t used = head - refresh_watermark(buffer);
+    size_t moved = 0;
+    while (used < buffer->spillThreshold && sbuffer_spill_size(buffer->spill) > 0) {
+        // read straight into the slots, up to the end of the ring
+        size_t index = head & (buffer->capacity - 1);
+        size_t n = buffer->spillThreshold - used;
+        if (n > buffer->capacity - index)
+            n = buffer->capacity - index;
+        n = sbuffer_spill_read(buffer->spill, &buffer->slots[index], n);
+        head += n;
+        used += n;
+        moved += n;
+    }
+    if (moved > 0) {
+        atomic_store(&buffer->head, head);
+        wake_consumers(buffer);
+    }
+    if (sbuffer_spill_size(buffer->spill) == 0)
+        atomic_store(&buffer->spilling, false);
+}
+
+// Logs 'data' under sequence number 'seq', unless it is being replayed from the log.
+static bool log_reading(sbuffer_t* buffer, size_t seq, sensor_data_t const* data, bool replaying) {
+    return buffer->wal == NULL || replaying || sbuffer_wal_append(buffer->wal, seq, data);
+}
+
+// Inserts 'data' when the spill is in use or the ring is past 'spillThreshold'.
+// Returns false if the reading couldn't be spilled and the overflow policy has to deal with it.
+static bool insert_spilling(sbuffer_t* buffer, sensor_data_t const* data, bool replaying, int* result) {
+    bool handled = true;
+    *result = SBUFFER_SUCCESS;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->spillLock) == 0);
+    refill_locked(buffer);
+    buffer->watermark = refresh_watermark(buffer);
+    size_t seq = atomic_load(&buffer->head);
+    if (sbuffer_spill_size(buffer->spill) > 0 || seq - buffer->watermark >= buffer->spillThreshold) {
+        // spilled readings get the slots after the ones spilled before them
+        if (!log_reading(buffer, seq + sbuffer_spill_size(buffer->spill), data, replaying)) {
+            *result = SBUFFER_FAILURE;
+        } else if (sbuffer_spill_append(buffer->spill, data)) {
+            atomic_store(&buffer->spilling, true);
+            atomic_fetch_add(&buffer->spilled, 1);
+        } else if (atomic_load(&buffer->spilling)) {
+            // the disk is full, and consumers may be refilling: reject rather than race with them
+            atomic_fetch_add(&buffer->rejected, 1);
+            *result = SBUFFER_FULL;
+        } else {
+            handled = false;
+        }
+    } else if (log_reading(buffer, seq, data, replaying)) {
+        // a false alarm, or the spill just drained
+        publish(buffer, seq, data);
+    } else {
+        *result = SBUFFER_FAILURE;
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->spillLock) == 0);
+    return handled;
+}
+
+// Replayed readings were accepted before, so they always wait for room instead of applying the policy.
+static int insert(sbuffer_t* buffer, sensor_data_t const* data, bool replaying) {
+    assert(buffer && data);
+    if (atomic_load_explicit(&buffer->closed, memory_order_relaxed))
+        return SBUFFER_FAILURE;
+
+    // Consumers refilling from the spill write 'head' too, but a refill moves 'head' before it clears
+    // 'spilling'. So 'spilling' is loaded first: once it reads false, 'head' is up to date and only
+    // the producer writes it, so no read-modify-write is needed.
+    bool spilling = buffer->spill != NULL && atomic_load_explicit(&buffer->spilling, memory_order_acquire);
+    size_t seq = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    if (buffer->spill != NULL && (spilling || seq - buffer->watermark >= buffer->spillThreshold)) {
+        int result;
+        if (insert_spilling(buffer, data, replaying, &result))
+            return result;
+    }
+    if (seq - buffer->watermark >= buffer->capacity) {
+        // the ring looks full: refresh the watermark, and apply the overflow policy if it really is
+        buffer->watermark = refresh_watermark(buffer);
+        if (seq - buffer->watermark >= buffer->capacity) {
+            switch (replaying ? SBUFFER_BLOCK : buffer->config.policy) {
+            case SBUFFER_BLOCK:
+                waitq_wait(&buffer->spaceAvailable, ready_to_insert, buffer, NULL);
+                if (atomic_load(&buffer->closed))
+                    return SBUFFER_FAILURE;
+                buffer->watermark = refresh_watermark(buffer);
+                break;
+            case SBUFFER_DROP_OLDEST:
+                buffer->watermark = seq + 1 - buffer->capacity;
+                drop_before(buffer, buffer->watermark);
+                atomic_fetch_add(&buffer->dropped, 1);
+                break;
+            case SBUFFER_REJECT_NEWEST:
+                atomic_fetch_add(&buffer->rejected, 1);
+                return SBUFFER_FULL;
+            }
+        }
+    }
+    if (!log_reading(buffer, seq, data, replaying))
+        return SBUFFER_FAILURE;
+    publish(buffer, seq, data);
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_insert_first(sbuffer_t* buffer, sensor_data_t const* data) {
+    assert(buffer);
+    if (buffer->config.producers == SBUFFER_SINGLE_PRODUCER)
+        return insert(buffer, data, false);
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->producerLock) == 0);
+    int result = insert(buffer, data, false);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->producerLock) == 0);
+    return result;
+}
+
+// Finds up to 'max' free slots after 'head', without wrapping around the end of the ring.
+// Returns 0 where insert() would spill or apply an overflow policy other than SBUFFER_BLOCK.
+static size_t reserve(sbuffer_t* buffer, size_t max, sensor_data_t** slots) {
+    if (max == 0 || atomic_load_explicit(&buffer->closed, memory_order_relaxed))
+        return 0;
+    // 'spilling' before 'head', as in insert()
+    size_t limit = buffer->capacity;
+    if (buffer->spill != NULL) {
+        if (atomic_load_explicit(&buffer->spilling, memory_order_acquire))
+            return 0;
+        limit = buffer->spillThreshold;
+    }
+    size_t seq = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    if (seq - buffer->watermark >= limit) {
+        buffer->watermark = refresh_watermark(buffer);
+        if (seq - buffer->watermark >= limit) {
+            if (buffer->spill != NULL || buffer->config.policy != SBUFFER_BLOCK)
+                return 0;
+            waitq_wait(&buffer->spaceAvailable, ready_to_insert, buffer, NULL);
+            if (atomic_load(&buffer->closed))
+                return 0;
+            buffer->watermark = refresh_watermark(buffer);
+        }
+    }
+    size_t index = seq & (buffer->capacity - 1);
+    size_t n = limit - (seq - buffer->watermark);
+    if (n > buffer->capacity - index)
+        n = buffer->capacity - index;
+    if (n > max)
+        n = max;
+    *slots = &buffer->slots[index];
+    return n;
+}
+
+size_t sbuffer_reserve(sbuffer_t* buffer, size_t max, sensor_data_t** slots) {
+    assert(buffer && slots);
+    bool multi = buffer->config.producers == SBUFFER_MULTI_PRODUCER;
+    if (multi)
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->producerLock) == 0);
+    assert(buffer->reserved == 0);
+    size_t reserved = reserve(buffer, max, slots);
+    buffer->reserved = reserved;
+    // without a reservation, 'head' is free for the other producers right away
+    if (multi && reserved == 0)
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->producerLock) == 0);
+    return reserved;
+}
+
+int sbuffer_commit(sbuffer_t* buffer, size_t n) {
+    assert(buffer && buffer->reserved > 0 && n <= buffer->reserved);
+    int result = SBUFFER_SUCCESS;
+    if (atomic_load_explicit(&buffer->closed, memory_order_relaxed) && n > 0) {
+        result = SBUFFER_FAILURE;
+        n = 0;
+    }
+    size_t seq = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    size_t logged = 0;
+    while (logged < n && log_reading(buffer, seq + logged, &buffer->slots[(seq + logged) & (buffer->capacity - 1)], false))
+        logged++;
+    if (logged < n)
+        result = SBUFFER_FAILURE;
+    if (logged > 0)
+        publish_up_to(buffer, seq + logged);
+    buffer->reserved = 0;
+    if (buffer->config.producers == SBUFFER_MULTI_PRODUCER)
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->producerLock) == 0);
+    return result;
+}
+
+void sbuffer_sync(sbuffer_t* buffer) {
+    assert(buffer);
+    if (buffer->wal != NULL)
+        sbuffer_wal_sync(buffer->wal);
+}
+
+size_t sbuffer_replay_wal(sbuffer_t* buffer) {
+    assert(buffer);
+    if (buffer->wal == NULL)
+        return 0;
+    size_t end = sbuffer_wal_end(buffer->wal);
+    size_t replayed = 0;
+    sensor_data_t chunk[64];
+    for (size_t seq = sbuffer_wal_start(buffer->wal); seq < end;) {
+        size_t n = sbuffer_wal_read(buffer->wal, seq, chunk, 64);
+        ASSERT_ELSE_PERROR(n > 0);
+        for (size_t i = 0; i < n && seq < end; i++, seq++) {
+            if (insert(buffer, &chunk[i], true) == SBUFFER_SUCCESS)
+                replayed++;
+        }
+    }
+    return replayed;
+}
+
+// ---------------------------------- GETTERS -----------------------------------------
+
+// Copies up to 'max' slots from the consumer's cursor on into 'out' and publishes the new cursor once.
+// A shard consumer also moves past the slots of other shards, up to the first slot of its own that doesn't fit;
+// 'hasOwn' (if not NULL) tells whether it stopped at such a slot.
+static size_t take(sbuffer_consumer_t* consumer, sensor_data_t* out, size_t max, bool* hasOwn) {
+    sbuffer_t* buffer = consumer->buffer;
+    bool canBeDropped = buffer->config.policy == SBUFFER_DROP_OLDEST;
+    if (canBeDropped)
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&consumer->takeLock) == 0);
+    // apart from drop_before(), only the owning consumer writes its cursor
+    size_t seq = atomic_load_explicit(&consumer->cursor, memory_order_relaxed);
+    // everything the storagemgr took before has been stored
+    if (buffer->wal != NULL && consumer == buffer->toStore)
+        sbuffer_wal_release(buffer->wal, seq);
+    size_t available = atomic_load_explicit(&buffer->head, memory_order_acquire) - seq;
+    size_t count = 0;
+    size_t passed = 0;
+    if (consumer->shards == 1) {
+        count = available < max ? available : max;
+        for (size_t i = 0; i < count; i++)
+            out[i] = buffer->slots[(seq + i) & (buffer->capacity - 1)];
+        passed = count;
+    } else {
+        for (; passed < available; passed++) {
+            const sensor_data_t* data = &buffer->slots[(seq + passed) & (buffer->capacity - 1)];
+            if (data->id % consumer->shards == consumer->shard) {
+                if (count == max)
+                    break;
+                out[count++] = *data;
+            }
+        }
+    }
+    if (hasOwn != NULL)
+        *hasOwn = passed < available;
+    atomic_store(&consumer->cursor, seq + passed);
+    if (canBeDropped)
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&consumer->takeLock) == 0);
+    if (passed == 0)
+        return 0;
+
+    // the producer may be waiting for this consumer to free a slot
+    waitq_wake(&buffer->spaceAvailable);
+    if (buffer->spill != NULL && atomic_load(&buffer->spilling)) {
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&buffer->spillLock) == 0);
+        if (atomic_load(&buffer->spilling))
+            refill_locked(buffer);
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&buffer->spillLock) == 0);
+    }
+    if (atomic_load_explicit(&buffer->aboveHighWatermark, memory_order_relaxed))
+        check_watermark(buffer, false);
+    return count;
+}
+
+sensor_data_t sbuffer_get_next(sbuffer_consumer_t* consumer) {
+    assert(consumer);
+    bool hasData = skip_other_shards(consumer);
+    assert(hasData);
+    (void) hasData;
+    sensor_data_t ret;
+    take(consumer, &ret, 1, NULL);
+    return ret;
+}
+
+sensor_data_t sbuffer_get_last_to_process(sbuffer_t* buffer) {
+    assert(buffer);
+    return sbuffer_get_next(buffer->toProcess[0]);
+}
+
+sensor_data_t sbuffer_get_last_to_store(sbuffer_t* buffer) {
+    assert(buffer);
+    return sbuffer_get_next(buffer->toStore);
+}
+
+// ------------------------------- BATCH GETTERS ----------------------------------------
+
+size_t sbuffer_take_batch(sbuffer_consumer_t* consumer, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(consumer && out);
+    size_t count = take(consumer, out, max, NULL);
+    if (count > 0 || timeout_ms == 0)
+        return count;
+    struct timespec deadline = deadline_after(timeout_ms);
+    // a shard consumer may be woken up for readings of other shards only
+    while (count == 0 && !atomic_load(&consumer->buffer->closed)
+           && waitq_wait(&consumer->dataAvailable, ready_to_take_or_closed, consumer, timeout_ms < 0 ? NULL : &deadline))
+        count = take(consumer, out, max, NULL);
+    return count;
+}
+
+size_t sbuffer_take_batch_to_process(sbuffer_t* buffer, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(buffer);
+    return sbuffer_take_batch(buffer->toProcess[0], out, max, timeout_ms);
+}
+
+size_t sbuffer_take_batch_to_process_shard(sbuffer_t* buffer, int shard, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(buffer && shard >= 0 && shard < buffer->processShards);
+    return sbuffer_take_batch(buffer->toProcess[shard], out, max, timeout_ms);
+}
+
+size_t sbuffer_take_batch_to_store(sbuffer_t* buffer, sensor_data_t* out, size_t max, int timeout_ms) {
+    assert(buffer);
+    return sbuffer_take_batch(buffer->toStore, out, max, timeout_ms);
+}
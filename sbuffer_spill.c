@@ -0,0 +1,171 @@
+/**
+ * \author Mathieu Erbas
+ *
+ * Segment files are numbered. The oldest segment is mapped for reading and
+ * the newest one for writing (they are the same mapping while the spill fits
+ * in one segment), the ones in between are only on disk. A segment is
+ * unlinked as soon as it has been read completely.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "sbuffer_spill.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SEGMENT_BYTES (SBUFFER_SPILL_SEGMENT_RECORDS * sizeof(sensor_data_t))
+
+struct sbuffer_spill {
+    char* dir;
+    size_t readSegment; // number of the oldest segment
+    size_t readOffset;
+    sensor_data_t* readMap;
+    size_t writeSegment; // number of the newest segment
+    size_t writeOffset;
+    sensor_data_t* writeMap;
+    size_t size;
+};
+
+static char* segment_path(sbuffer_spill_t* spill, size_t segment) {
+    char* path = NULL;
+    // the pid keeps two servers that share a spill directory apart
+    ASSERT_ELSE_PERROR(asprintf(&path, "%s/sbuffer-%d-%zu.spill", spill->dir, (int) getpid(), segment) > 0);
+    return path;
+}
+
+static sensor_data_t* map_segment(sbuffer_spill_t* spill, size_t segment, bool create) {
+    char* path = segment_path(spill, segment);
+    int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, S_IRUSR | S_IWUSR);
+    free(path);
+    if (fd < 0) {
+        perror("Opening spill segment failed");
+        return NULL;
+    }
+    if (create && ftruncate(fd, SEGMENT_BYTES) != 0) {
+        perror("Growing spill segment failed");
+        close(fd);
+        return NULL;
+    }
+    void* map = mmap(NULL, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Mapping spill segment failed");
+        return NULL;
+    }
+    return map;
+}
+
+static void unmap_segment(sensor_data_t* map) {
+    ASSERT_ELSE_PERROR(munmap(map, SEGMENT_BYTES) == 0);
+}
+
+static void remove_segment(sbuffer_spill_t* spill, size_t segment) {
+    char* path = segment_path(spill, segment);
+    unlink(path);
+    free(path);
+}
+
+sbuffer_spill_t* sbuffer_spill_open(const char* dir) {
+    assert(dir);
+    if (access(dir, W_OK) != 0) {
+        perror("Spill directory is not writable");
+        return NULL;
+    }
+    sbuffer_spill_t* spill = malloc(sizeof(*spill));
+    assert(spill != NULL);
+    *spill = (sbuffer_spill_t){
+        .dir = strdup(dir),
+        .readSegment = 0,
+        .readOffset = 0,
+        .readMap = NULL,
+        .writeSegment = 0,
+        .writeOffset = SBUFFER_SPILL_SEGMENT_RECORDS, // the first append creates segment 0
+        .writeMap = NULL,
+        .size = 0,
+    };
+    return spill;
+}
+
+void sbuffer_spill_close(sbuffer_spill_t* spill) {
+    assert(spill);
+    if (spill->readMap != NULL && spill->readMap != spill->writeMap)
+        unmap_segment(spill->readMap);
+    if (spill->writeMap != NULL)
+        unmap_segment(spill->writeMap);
+    // while a segment is mapped for writing, all segments from the oldest one on exist
+    if (spill->writeMap != NULL) {
+        for (size_t segment = spill->readSegment; segment <= spill->writeSegment; segment++)
+            remove_segment(spill, segment);
+    }
+    free(spill->dir);
+    free(spill);
+}
+
+bool sbuffer_spill_append(sbuffer_spill_t* spill, const sensor_data_t* data) {
+    assert(spill && data);
+    if (spill->writeOffset == SBUFFER_SPILL_SEGMENT_RECORDS) {
+        // the newest segment is full (or there is none): start a new one,
+        // right after it or, if everything was read and removed, at the read position
+        size_t segment = spill->writeMap == NULL ? spill->readSegment : spill->writeSegment + 1;
+        sensor_data_t* map = map_segment(spill, segment, true);
+        if (map == NULL)
+            return false;
+        if (spill->writeMap != NULL && spill->writeMap != spill->readMap)
+            unmap_segment(spill->writeMap);
+        spill->writeSegment = segment;
+        spill->writeOffset = 0;
+        spill->writeMap = map;
+    }
+    spill->writeMap[spill->writeOffset++] = *data;
+    spill->size++;
+    return true;
+}
+
+size_t sbuffer_spill_read(sbuffer_spill_t* spill, sensor_data_t* out, size_t max) {
+    assert(spill && out);
+    size_t count = 0;
+    while (count < max && spill->size > 0) {
+        if (spill->readMap == NULL) {
+            spill->readMap = spill->readSegment == spill->writeSegment
+                                 ? spill->writeMap
+                                 : map_segment(spill, spill->readSegment, false);
+            // the segment was created by this process, so this only fails if someone removed it
+            ASSERT_ELSE_PERROR(spill->readMap != NULL);
+        }
+
+        size_t end = spill->readSegment == spill->writeSegment ? spill->writeOffset : SBUFFER_SPILL_SEGMENT_RECORDS;
+        size_t n = end - spill->readOffset;
+        if (n > max - count)
+            n = max - count;
+        memcpy(out + count, spill->readMap + spill->readOffset, n * sizeof(*out));
+        spill->readOffset += n;
+        spill->size -= n;
+        count += n;
+
+        if (spill->readOffset == SBUFFER_SPILL_SEGMENT_RECORDS) {
+            // this segment has been read completely
+            unmap_segment(spill->readMap);
+            if (spill->readMap == spill->writeMap)
+                spill->writeMap = NULL;
+            remove_segment(spill, spill->readSegment);
+            spill->readMap = NULL;
+            spill->readSegment++;
+            spill->readOffset = 0;
+        }
+    }
+    return count;
+}
+
+size_t sbuffer_spill_size(sbuffer_spill_t* spill) {
+    assert(spill);
+    return spill->size;
+}
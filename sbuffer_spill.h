@@ -0,0 +1,52 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ *
+ * Overflow tier of the shared buffer: a FIFO of readings in memory-mapped
+ * segment files. Only the sbuffer engines use this, and they serialize all
+ * calls on one spill themselves.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stddef.h>
+
+// number of readings per segment file
+#ifndef SBUFFER_SPILL_SEGMENT_RECORDS
+    #define SBUFFER_SPILL_SEGMENT_RECORDS 65536
+#endif
+
+typedef struct sbuffer_spill sbuffer_spill_t;
+
+/**
+ * Creates an empty spill that keeps its segment files in directory 'dir'
+ * \return the spill, or NULL if 'dir' can't be used
+ */
+sbuffer_spill_t* sbuffer_spill_open(const char* dir);
+
+/**
+ * Unmaps and deletes all segment files, and frees the spill
+ */
+void sbuffer_spill_close(sbuffer_spill_t* spill);
+
+/**
+ * Appends a reading at the end of the spill
+ * \return false if a new segment file couldn't be created
+ */
+bool sbuffer_spill_append(sbuffer_spill_t* spill, const sensor_data_t* data);
+
+/**
+ * Removes up to 'max' of the oldest readings from the spill and copies them into 'out'
+ * \return the number of readings copied
+ */
+size_t sbuffer_spill_read(sbuffer_spill_t* spill, sensor_data_t* out, size_t max);
+
+/**
+ * Returns the number of readings in the spill
+ */
+size_t sbuffer_spill_size(sbuffer_spill_t* spill);
@@ -0,0 +1,381 @@
+/**
+ * \author Mathieu Erbas
+ *
+ * Record 'seq' lives in segment file seq / SBUFFER_WAL_SEGMENT_RECORDS, at a
+ * fixed offset, so re-appending a sequence number overwrites its old record.
+ * The 'checkpoint' file holds the sequence number of the oldest reading that
+ * wasn't stored yet; everything before it is never replayed, and segments
+ * that only hold such readings are removed. A record carries its sequence
+ * number and a checksum, so a torn write at the end is detected at open.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "sbuffer_wal.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// number of records read at once when scanning a segment
+#define SCAN_CHUNK 256
+
+typedef struct {
+    uint64_t seq;
+    sensor_data_t data;
+    uint32_t check;
+} wal_record_t;
+
+struct sbuffer_wal {
+    char* dir;
+    int syncMs;
+    size_t start; // replay range found at open
+    size_t end;
+
+    int fd; // segment the producer writes to, -1 before the first append
+    size_t fdSegment;
+    atomic_size_t written;  // number of records written so far
+    atomic_size_t released; // all readings before this sequence number have been stored
+
+    // guards 'fd' and 'synced', wakes the flusher up to sync or stop, and the producers once synced
+    pthread_mutex_t lock;
+    pthread_cond_t stopCond;
+    pthread_cond_t syncedCond;
+    bool stop;
+    bool syncWanted; // a producer waits in sbuffer_wal_sync
+    pthread_t flusher;
+    size_t synced;     // flusher's copy of 'written' at its last fsync
+    size_t checkpoint; // last sequence number written to the checkpoint file
+};
+
+// FNV-1a over everything in the record but the checksum itself
+static uint32_t record_check(const wal_record_t* record) {
+    const unsigned char* bytes = (const unsigned char*) record;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(wal_record_t, check); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+static char* wal_path(sbuffer_wal_t* wal, const char* name) {
+    char* path = NULL;
+    ASSERT_ELSE_PERROR(asprintf(&path, "%s/%s", wal->dir, name) > 0);
+    return path;
+}
+
+static int open_segment(sbuffer_wal_t* wal, size_t segment, int flags) {
+    char* path = NULL;
+    ASSERT_ELSE_PERROR(asprintf(&path, "%s/sbuffer-%zu.wal", wal->dir, segment) > 0);
+    int fd = open(path, flags, S_IRUSR | S_IWUSR);
+    free(path);
+    return fd;
+}
+
+static off_t record_offset(size_t seq) {
+    return (off_t) (seq % SBUFFER_WAL_SEGMENT_RECORDS) * (off_t) sizeof(wal_record_t);
+}
+
+// fsyncs the directory, so files created or renamed in it survive a crash
+static bool sync_dir(sbuffer_wal_t* wal) {
+    int dirFd = open(wal->dir, O_RDONLY | O_DIRECTORY);
+    bool ok = dirFd >= 0 && fsync(dirFd) == 0;
+    if (dirFd >= 0)
+        close(dirFd);
+    return ok;
+}
+
+// -------------------------- CHECKPOINT -------------------------------------------
+
+static size_t read_checkpoint(sbuffer_wal_t* wal) {
+    char* path = wal_path(wal, "checkpoint");
+    int fd = open(path, O_RDONLY);
+    free(path);
+    uint64_t checkpoint = 0;
+    if (fd >= 0) {
+        if (read(fd, &checkpoint, sizeof(checkpoint)) != sizeof(checkpoint))
+            checkpoint = 0;
+        close(fd);
+    }
+    return checkpoint;
+}
+
+// Replaces the checkpoint file atomically, and makes sure the new one is on disk
+// before any segment it allows to remove is removed.
+static bool write_checkpoint(sbuffer_wal_t* wal, size_t seq) {
+    char* tmpPath = wal_path(wal, "checkpoint.tmp");
+    char* path = wal_path(wal, "checkpoint");
+    uint64_t checkpoint = seq;
+    bool ok = false;
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd >= 0) {
+        ok = write(fd, &checkpoint, sizeof(checkpoint)) == sizeof(checkpoint) && fdatasync(fd) == 0;
+        close(fd);
+    }
+    ok = ok && rename(tmpPath, path) == 0 && sync_dir(wal);
+    if (!ok)
+        perror("Writing WAL checkpoint failed");
+    free(tmpPath);
+    free(path);
+    return ok;
+}
+
+// -------------------------- FLUSHER -------------------------------------------
+
+// fsyncs what was written since the last call, wakes up the producers waiting for it,
+// and moves the checkpoint up to what was stored
+static void flush(sbuffer_wal_t* wal) {
+    size_t written = atomic_load(&wal->written);
+    if (written != wal->synced) {
+        // sync a duplicate, so the producer can switch segments in the meantime;
+        // it syncs the previous segment itself before switching
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&wal->lock) == 0);
+        int fd = wal->fd >= 0 ? dup(wal->fd) : -1;
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&wal->lock) == 0);
+        if (fd >= 0) {
+            if (fdatasync(fd) != 0)
+                perror("Syncing WAL failed");
+            close(fd);
+        }
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&wal->lock) == 0);
+        wal->synced = written;
+        ASSERT_ELSE_PERROR(pthread_cond_broadcast(&wal->syncedCond) == 0);
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&wal->lock) == 0);
+    }
+
+    size_t released = atomic_load(&wal->released);
+    if (released > wal->checkpoint && write_checkpoint(wal, released)) {
+        // the producer is past these segments, they only hold stored readings
+        for (size_t segment = wal->checkpoint / SBUFFER_WAL_SEGMENT_RECORDS; segment < released / SBUFFER_WAL_SEGMENT_RECORDS; segment++) {
+            char* path = NULL;
+            ASSERT_ELSE_PERROR(asprintf(&path, "%s/sbuffer-%zu.wal", wal->dir, segment) > 0);
+            unlink(path);
+            free(path);
+        }
+        wal->checkpoint = released;
+    }
+}
+
+static void* flusher_run(void* arg) {
+    sbuffer_wal_t* wal = arg;
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&wal->lock) == 0);
+    while (!wal->stop) {
+        // producers that show up during a sync wait for the next one, so they share it
+        if (!wal->syncWanted) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long) wal->syncMs * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            int errorValue = pthread_cond_timedwait(&wal->stopCond, &wal->lock, &deadline);
+            ASSERT_ELSE_PERROR((errorValue == 0) || (errorValue == ETIMEDOUT));
+        }
+        wal->syncWanted = false;
+
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&wal->lock) == 0);
+        flush(wal);
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&wal->lock) == 0);
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&wal->lock) == 0);
+    return NULL;
+}
+
+// -------------------------- OPEN / CLOSE -------------------------------------------
+
+// Returns the sequence number after the last valid record from 'seq' on.
+static size_t scan(sbuffer_wal_t* wal, size_t seq) {
+    wal_record_t records[SCAN_CHUNK];
+    for (;;) {
+        int fd = open_segment(wal, seq / SBUFFER_WAL_SEGMENT_RECORDS, O_RDONLY);
+        if (fd < 0)
+            return seq;
+        bool valid = true;
+        while (valid) {
+            size_t room = SBUFFER_WAL_SEGMENT_RECORDS - seq % SBUFFER_WAL_SEGMENT_RECORDS;
+            size_t want = room < SCAN_CHUNK ? room : SCAN_CHUNK;
+            ssize_t got = pread(fd, records, want * sizeof(wal_record_t), record_offset(seq));
+            size_t count = got > 0 ? (size_t) got / sizeof(wal_record_t) : 0;
+            size_t i = 0;
+            while (i < count && records[i].seq == seq + i && records[i].check == record_check(&records[i]))
+                i++;
+            seq += i;
+            valid = i == want && i > 0;
+            if (valid && seq % SBUFFER_WAL_SEGMENT_RECORDS == 0)
+                break; // on to the next segment
+        }
+        close(fd);
+        if (!valid)
+            return seq;
+    }
+}
+
+// Removes segments outside [start, end), and whatever follows 'end' in its segment,
+// so records from an older run can't be mistaken for new ones later.
+static void remove_stale(sbuffer_wal_t* wal) {
+    DIR* dir = opendir(wal->dir);
+    ASSERT_ELSE_PERROR(dir != NULL);
+    size_t first = wal->start / SBUFFER_WAL_SEGMENT_RECORDS;
+    size_t last = wal->end / SBUFFER_WAL_SEGMENT_RECORDS;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t segment;
+        char tail;
+        if (sscanf(entry->d_name, "sbuffer-%zu.wa%c", &segment, &tail) != 2 || tail != 'l')
+            continue;
+        if (segment < first || segment > last) {
+            char* path = wal_path(wal, entry->d_name);
+            unlink(path);
+            free(path);
+        }
+    }
+    closedir(dir);
+
+    int fd = open_segment(wal, last, O_WRONLY);
+    if (fd >= 0) {
+        ASSERT_ELSE_PERROR(ftruncate(fd, record_offset(wal->end)) == 0);
+        close(fd);
+    }
+}
+
+sbuffer_wal_t* sbuffer_wal_open(const char* dir, int sync_ms) {
+    assert(dir);
+    if (access(dir, W_OK) != 0) {
+        perror("WAL directory is not writable");
+        return NULL;
+    }
+    sbuffer_wal_t* wal = malloc(sizeof(*wal));
+    assert(wal != NULL);
+    wal->dir = strdup(dir);
+    wal->syncMs = sync_ms > 0 ? sync_ms : SBUFFER_WAL_SYNC_MS;
+    wal->start = read_checkpoint(wal);
+    wal->end = scan(wal, wal->start);
+    remove_stale(wal);
+    if (wal->end != wal->start)
+        printf("WAL holds %zu readings that weren't stored\n", wal->end - wal->start);
+
+    wal->fd = -1;
+    wal->fdSegment = 0;
+    atomic_init(&wal->written, 0);
+    atomic_init(&wal->released, wal->start);
+    wal->stop = false;
+    wal->syncWanted = false;
+    wal->synced = 0;
+    wal->checkpoint = wal->start;
+    ASSERT_ELSE_PERROR(pthread_mutex_init(&wal->lock, NULL) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_init(&wal->stopCond, NULL) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_init(&wal->syncedCond, NULL) == 0);
+    ASSERT_ELSE_PERROR(pthread_create(&wal->flusher, NULL, flusher_run, wal) == 0);
+    return wal;
+}
+
+void sbuffer_wal_close(sbuffer_wal_t* wal) {
+    assert(wal);
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&wal->lock) == 0);
+    wal->stop = true;
+    ASSERT_ELSE_PERROR(pthread_cond_signal(&wal->stopCond) == 0);
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&wal->lock) == 0);
+    ASSERT_ELSE_PERROR(pthread_join(wal->flusher, NULL) == 0);
+
+    flush(wal);
+    if (wal->fd >= 0)
+        close(wal->fd);
+    ASSERT_ELSE_PERROR(pthread_mutex_destroy(&wal->lock) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_destroy(&wal->stopCond) == 0);
+    ASSERT_ELSE_PERROR(pthread_cond_destroy(&wal->syncedCond) == 0);
+    free(wal->dir);
+    free(wal);
+}
+
+// -------------------------- RECORDS -------------------------------------------
+
+size_t sbuffer_wal_start(sbuffer_wal_t* wal) {
+    assert(wal);
+    return wal->start;
+}
+
+size_t sbuffer_wal_end(sbuffer_wal_t* wal) {
+    assert(wal);
+    return wal->end;
+}
+
+bool sbuffer_wal_append(sbuffer_wal_t* wal, size_t seq, const sensor_data_t* data) {
+    assert(wal && data);
+    size_t segment = seq / SBUFFER_WAL_SEGMENT_RECORDS;
+    if (wal->fd < 0 || segment != wal->fdSegment) {
+        int fd = open_segment(wal, segment, O_WRONLY | O_CREAT);
+        if (fd < 0 || !sync_dir(wal)) {
+            perror("Opening WAL segment failed");
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        // the flusher only syncs the current segment, so finish the previous one before it sees the new one
+        int old = wal->fd;
+        if (old >= 0 && fdatasync(old) != 0)
+            perror("Syncing WAL failed");
+        ASSERT_ELSE_PERROR(pthread_mutex_lock(&wal->lock) == 0);
+        wal->fd = fd;
+        wal->fdSegment = segment;
+        ASSERT_ELSE_PERROR(pthread_mutex_unlock(&wal->lock) == 0);
+        if (old >= 0)
+            close(old);
+    }
+
+    wal_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.seq = seq;
+    record.data = *data;
+    record.check = record_check(&record);
+    if (pwrite(wal->fd, &record, sizeof(record), record_offset(seq)) != sizeof(record)) {
+        perror("Writing WAL record failed");
+        return false;
+    }
+    atomic_fetch_add(&wal->written, 1);
+    return true;
+}
+
+void sbuffer_wal_sync(sbuffer_wal_t* wal) {
+    assert(wal);
+    size_t written = atomic_load(&wal->written);
+    ASSERT_ELSE_PERROR(pthread_mutex_lock(&wal->lock) == 0);
+    while (wal->synced < written) {
+        if (!wal->syncWanted) {
+            wal->syncWanted = true;
+            ASSERT_ELSE_PERROR(pthread_cond_signal(&wal->stopCond) == 0);
+        }
+        ASSERT_ELSE_PERROR(pthread_cond_wait(&wal->syncedCond, &wal->lock) == 0);
+    }
+    ASSERT_ELSE_PERROR(pthread_mutex_unlock(&wal->lock) == 0);
+}
+
+size_t sbuffer_wal_read(sbuffer_wal_t* wal, size_t seq, sensor_data_t* out, size_t max) {
+    assert(wal && out);
+    wal_record_t records[SCAN_CHUNK];
+    size_t room = SBUFFER_WAL_SEGMENT_RECORDS - seq % SBUFFER_WAL_SEGMENT_RECORDS;
+    size_t want = max < room ? max : room;
+    if (want > SCAN_CHUNK)
+        want = SCAN_CHUNK;
+    int fd = open_segment(wal, seq / SBUFFER_WAL_SEGMENT_RECORDS, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    ssize_t got = pread(fd, records, want * sizeof(wal_record_t), record_offset(seq));
+    close(fd);
+    size_t count = got > 0 ? (size_t) got / sizeof(wal_record_t) : 0;
+    for (size_t i = 0; i < count; i++)
+        out[i] = records[i].data;
+    return count;
+}
+
+void sbuffer_wal_release(sbuffer_wal_t* wal, size_t seq) {
+    assert(wal);
+    atomic_store(&wal->released, seq);
+}
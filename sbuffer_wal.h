@@ -0,0 +1,80 @@
+#pragma once
+
+/**
+ * \author Mathieu Erbas
+ *
+ * Write-ahead log of the shared buffer: every accepted reading is written to
+ * a segment file, under the sequence number the buffer gives it, and is on
+ * disk once sbuffer_sync returns. A background thread fsyncs what all
+ * producers wrote in the meantime at once (group commit), at least every
+ * 'sync_ms' milliseconds, and removes the segments the storagemgr is done
+ * with. Only the sbuffer engines use this, and they serialize
+ * sbuffer_wal_append calls themselves.
+ */
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "config.h"
+
+#include <stddef.h>
+
+// number of records per segment file
+#ifndef SBUFFER_WAL_SEGMENT_RECORDS
+    #define SBUFFER_WAL_SEGMENT_RECORDS 65536
+#endif
+
+// default longest time between two fsyncs of the log
+#ifndef SBUFFER_WAL_SYNC_MS
+    #define SBUFFER_WAL_SYNC_MS 10
+#endif
+
+typedef struct sbuffer_wal sbuffer_wal_t;
+
+/**
+ * Opens the log in directory 'dir', recovering what a previous run left behind
+ * \param sync_ms longest time between two fsyncs, 0 for SBUFFER_WAL_SYNC_MS
+ * \return the log, or NULL if 'dir' can't be used
+ */
+sbuffer_wal_t* sbuffer_wal_open(const char* dir, int sync_ms);
+
+/**
+ * Syncs the log, records what was stored, and frees the log
+ */
+void sbuffer_wal_close(sbuffer_wal_t* wal);
+
+/**
+ * Returns the sequence number of the oldest reading that wasn't stored yet when the log was opened
+ */
+size_t sbuffer_wal_start(sbuffer_wal_t* wal);
+
+/**
+ * Returns the sequence number after the newest reading found when the log was opened
+ * Readings [start, end) have to be replayed into the buffer.
+ */
+size_t sbuffer_wal_end(sbuffer_wal_t* wal);
+
+/**
+ * Writes 'data' as the reading with sequence number 'seq', replacing an earlier record with that number
+ * \return false if the record couldn't be written
+ */
+bool sbuffer_wal_append(sbuffer_wal_t* wal, size_t seq, const sensor_data_t* data);
+
+/**
+ * Waits until every record appended so far is on disk
+ * Meant to be called after releasing the engine's locks, so producers share an fsync.
+ */
+void sbuffer_wal_sync(sbuffer_wal_t* wal);
+
+/**
+ * Copies up to 'max' readings from sequence number 'seq' on into 'out'
+ * \return the number of readings copied
+ */
+size_t sbuffer_wal_read(sbuffer_wal_t* wal, size_t seq, sensor_data_t* out, size_t max);
+
+/**
+ * Tells the log that all readings before sequence number 'seq' have been stored,
+ * so their records may be removed
+ */
+void sbuffer_wal_release(sbuffer_wal_t* wal, size_t seq);
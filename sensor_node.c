@@ -4,6 +4,7 @@
 
 #include "config.h"
 #include "lib/tcpsock.h"
+#include "sensor_protocol.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,11 +51,72 @@
     #define LOG_CLOSE(...) (void) 0
 #endif
 
+// conditional compilation option to send the readings in version 2 frames of FRAME_READINGS readings each
+// A frame is only sent once it is full, and the connmgr drops a connection that sends nothing for TIMEOUT seconds,
+// so with a sleep time of s seconds a frame holds at most (TIMEOUT - 1) / s readings (and at least one).
+#ifndef PROTOCOL_VERSION
+    #define PROTOCOL_VERSION 1
+#endif
+#ifndef FRAME_READINGS
+    #define FRAME_READINGS 4
+#endif
+
 #define INITIAL_TEMPERATURE 22.5
 #define TEMP_DEV 0.5 // max deviation from previous temp in celsius
 
 void print_help(void);
 
+typedef struct {
+    unsigned char bytes[SENSOR_FRAME_HEADER_SIZE + FRAME_READINGS * SENSOR_FRAME_RECORD_SIZE];
+    sensor_frame_count_t count;
+    sensor_frame_count_t limit; // readings per frame, at most FRAME_READINGS
+    sensor_frame_sequence_t sequence;
+    sensor_ts_t lastTs;
+} frame_t;
+
+/**
+ * Sends the readings collected in 'frame' as one version 2 frame, if there are any
+ */
+void send_frame(tcpsock_t* client, frame_t* frame) {
+    if (frame->count == 0)
+        return;
+    memcpy(frame->bytes + sizeof(sensor_id_t) + 1 + sizeof(frame->sequence) + sizeof(sensor_id_t), &frame->count, sizeof(frame->count));
+    int bytes = SENSOR_FRAME_HEADER_SIZE + frame->count * SENSOR_FRAME_RECORD_SIZE;
+    if (tcp_send(client, frame->bytes, &bytes) != TCP_NO_ERROR)
+        exit(EXIT_FAILURE);
+    frame->count = 0;
+    frame->sequence++;
+}
+
+/**
+ * Adds a reading to 'frame', and sends the frame once it's full
+ */
+void add_to_frame(tcpsock_t* client, frame_t* frame, const sensor_data_t* data) {
+    // a timestamp that can't be told as a delta starts a new frame
+    if (frame->count > 0 && (data->ts < frame->lastTs || data->ts - frame->lastTs > UINT16_MAX))
+        send_frame(client, frame);
+    if (frame->count == 0) {
+        const sensor_id_t marker = SENSOR_PROTOCOL_MARKER;
+        unsigned char* field = frame->bytes;
+        memcpy(field, &marker, sizeof(marker));
+        field += sizeof(marker);
+        field[0] = SENSOR_PROTOCOL_VERSION;
+        field[1] = frame->sequence;
+        field += 1 + sizeof(frame->sequence);
+        memcpy(field, &data->id, sizeof(data->id));
+        field += sizeof(data->id) + sizeof(frame->count);
+        memcpy(field, &data->ts, sizeof(data->ts));
+        frame->lastTs = data->ts;
+    }
+    unsigned char* record = frame->bytes + SENSOR_FRAME_HEADER_SIZE + frame->count * SENSOR_FRAME_RECORD_SIZE;
+    const sensor_ts_delta_t delta = data->ts - frame->lastTs;
+    memcpy(record, &data->value, sizeof(data->value));
+    memcpy(record + sizeof(data->value), &delta, sizeof(delta));
+    frame->lastTs = data->ts;
+    if (++frame->count == frame->limit)
+        send_frame(client, frame);
+}
+
 double normalized_rand() {
     const double min = -1.0;
     const double max = 1.0;
@@ -80,6 +142,7 @@ int main(int argc, char* argv[]) {
     char server_ip[] = "000.000.000.000";
     tcpsock_t* client;
     int i, bytes, sleep_time;
+    frame_t frame = {.count = 0, .limit = FRAME_READINGS, .sequence = 0};
 
     LOG_OPEN();
 
@@ -94,6 +157,10 @@ int main(int argc, char* argv[]) {
         server_port = atoi(argv[4]);
     }
 
+    // send a frame before the connmgr's idle timeout expires
+    if (sleep_time > 0 && FRAME_READINGS * sleep_time >= TIMEOUT)
+        frame.limit = sleep_time < TIMEOUT ? (TIMEOUT - 1) / sleep_time : 1;
+
     srand48(time(NULL));
     srand(time(NULL));
 
@@ -106,6 +173,11 @@ int main(int argc, char* argv[]) {
     while (i) {
         data.value = data.value + TEMP_DEV * (normalized_rand() - (data.value - INITIAL_TEMPERATURE) / 100.0);
         time(&data.ts);
+#if PROTOCOL_VERSION == 2
+        (void) bytes;
+        add_to_frame(client, &frame, &data);
+#else
+        (void) frame;
         // send data to server in this order (!!):
         // <sensor_id><temperature><timestamp> remark: don't send as a struct!
         bytes = sizeof(data.id);
@@ -117,10 +189,14 @@ int main(int argc, char* argv[]) {
         bytes = sizeof(data.ts);
         if (tcp_send(client, (void*) &data.ts, &bytes) != TCP_NO_ERROR)
             exit(EXIT_FAILURE);
+#endif
         LOG_PRINTF(data.id, data.value, data.ts);
         sleep(sleep_time);
         UPDATE(i);
     }
+#if PROTOCOL_VERSION == 2
+    send_frame(client, &frame);
+#endif
 
     if (tcp_close(&client) != TCP_NO_ERROR)
         exit(EXIT_FAILURE);
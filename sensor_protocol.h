@@ -0,0 +1,39 @@
+/**
+ * \author Mathieu Erbas
+ *
+ * What sensors send to the connmgr. Everything is in host byte order, without padding.
+ *
+ * Version 1 is a stream of readings: <sensor id><value><timestamp>.
+ *
+ * Version 2 is a stream of frames, each one a header followed by 'count' records:
+ *   header: <marker><version><sequence><sensor id><count><timestamp of the first record>
+ *   record: <value><seconds since the previous record, or since the header timestamp for the first one>
+ * so a frame of n readings takes 16 + 10 * n bytes instead of 18 * n.
+ *
+ * The connmgr tells the versions apart by the first two bytes of a connection:
+ * the marker is a sensor id that version 1 sensors must not use.
+ *
+ * Over UDP, a datagram holds whole version 1 readings, or whole version 2 frames.
+ * The sequence number of a frame is one more (modulo 256) than the one of the previous
+ * frame of the same sensor, so the connmgr can count lost and duplicated frames.
+ */
+
+#pragma once
+
+#include "config.h"
+
+#include <stdint.h>
+
+#define SENSOR_PROTOCOL_MARKER ((sensor_id_t) 0xFFFF)
+#define SENSOR_PROTOCOL_VERSION 2
+
+typedef uint8_t sensor_frame_sequence_t;
+typedef uint16_t sensor_frame_count_t;
+typedef uint16_t sensor_ts_delta_t;
+
+// size of a version 1 reading
+#define SENSOR_RECORD_SIZE (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+
+// size of a version 2 frame header and of each of its records
+#define SENSOR_FRAME_HEADER_SIZE (sizeof(sensor_id_t) + 1 + sizeof(sensor_frame_sequence_t) + sizeof(sensor_id_t) + sizeof(sensor_frame_count_t) + sizeof(sensor_ts_t))
+#define SENSOR_FRAME_RECORD_SIZE (sizeof(sensor_value_t) + sizeof(sensor_ts_delta_t))
@@ -0,0 +1,91 @@
+/**
+ * \author Mathieu Erbas
+ */
+
+#include "datamgr.h"
+#include "room_map.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Writes 'text' to a new temporary file, whose path is returned.
+static char* write_map(const char* text) {
+    char* path = strdup("/tmp/test_room_map_XXXXXX");
+    assert(path);
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(write(fd, text, strlen(text)) == (ssize_t) strlen(text));
+    close(fd);
+    return path;
+}
+
+static room_map_t* load(const char* text) {
+    char* path = write_map(text);
+    room_map_t* map = room_map_load(path);
+    unlink(path);
+    free(path);
+    return map;
+}
+
+// a map without any line has no rooms or zones, and the datamgr keeps zero-length aggregates for it
+static void test_empty(void) {
+    room_map_t* map = load("# no sensors yet\n\n   \n");
+    assert(map != NULL);
+    assert(room_map_room_count(map) == 0 && room_map_zone_count(map) == 0);
+    assert(room_map_room_of(map, 1) == ROOM_MAP_NONE);
+    assert(room_map_find_room(map, 1) == ROOM_MAP_NONE && room_map_find_zone(map, 1) == ROOM_MAP_NONE);
+
+    datamgr_t* datamgr = datamgr_init(&(datamgr_config_t){.rooms = map});
+    datamgr_process_reading(datamgr, &(sensor_data_t){.id = 1, .value = 20, .ts = 1});
+    datamgr_group_stats_t stats;
+    assert(!datamgr_get_room_stats(datamgr, 0, &stats));
+    assert(!datamgr_get_zone_stats(datamgr, 0, &stats));
+    datamgr_free(datamgr);
+    room_map_free(map);
+}
+
+static void test_rooms_and_zones(void) {
+    room_map_t* map = load("30 3 2\n10 1 2\n10 2 2\n# a room without a zone\n20 4\n");
+    assert(map != NULL);
+    assert(room_map_room_count(map) == 3 && room_map_zone_count(map) == 1);
+    // indexes follow the ids
+    assert(room_map_room_id(map, 0) == 10 && room_map_room_id(map, 1) == 20 && room_map_room_id(map, 2) == 30);
+    assert(room_map_room_of(map, 1) == 0 && room_map_room_of(map, 2) == 0 && room_map_room_of(map, 4) == 1);
+    assert(room_map_room_of(map, 5) == ROOM_MAP_NONE);
+    assert(room_map_zone_of(map, 0) == 0 && room_map_zone_of(map, 1) == ROOM_MAP_NONE && room_map_zone_of(map, 2) == 0);
+    assert(room_map_find_room(map, 30) == 2 && room_map_find_zone(map, 2) == 0);
+
+    datamgr_t* datamgr = datamgr_init(&(datamgr_config_t){.window = 1, .rooms = map});
+    datamgr_process_reading(datamgr, &(sensor_data_t){.id = 1, .value = 10, .ts = 1});
+    datamgr_process_reading(datamgr, &(sensor_data_t){.id = 2, .value = 20, .ts = 1});
+    datamgr_process_reading(datamgr, &(sensor_data_t){.id = 3, .value = 30, .ts = 1});
+    datamgr_process_reading(datamgr, &(sensor_data_t){.id = 5, .value = 99, .ts = 1}); // not in the map
+    datamgr_group_stats_t stats;
+    assert(datamgr_get_room_stats(datamgr, 0, &stats));
+    assert(stats.sensors == 2 && stats.average == 15);
+    assert(datamgr_get_room_stats(datamgr, 1, &stats) && stats.sensors == 0 && stats.average == 0);
+    assert(datamgr_get_zone_stats(datamgr, 0, &stats));
+    assert(stats.sensors == 3 && stats.average == 20);
+    datamgr_free(datamgr);
+    room_map_free(map);
+}
+
+static void test_malformed(void) {
+    assert(load("10 1\n20 1\n") == NULL);       // sensor in two rooms
+    assert(load("10 1 1\n10 2 2\n") == NULL);   // room in two zones
+    assert(load("10 1 1\n10 2\n") == NULL);     // room with and without a zone
+    assert(load("10\n") == NULL);               // no sensor id
+    assert(load("10 1 2 3\n") == NULL);         // trailing field
+    assert(load("10 70000\n") == NULL);         // sensor id out of range
+    assert(room_map_load("/nonexistent/room.map") == NULL);
+}
+
+int main(void) {
+    test_empty();
+    test_rooms_and_zones();
+    test_malformed();
+    return 0;
+}
@@ -0,0 +1,87 @@
+/**
+ * \author Mathieu Erbas
+ */
+
+#include "lib/slotmap.h"
+
+#include <assert.h>
+#include <stdbool.h>
+
+#define ELEMENTS 100
+
+static int values[ELEMENTS];
+
+static void test_insert_get(void) {
+    slotmap_t* map = slotmap_create();
+    assert(slotmap_get(map, SLOTMAP_NO_HANDLE) == NULL);
+    slotmap_handle_t handles[ELEMENTS];
+    for (int i = 0; i < ELEMENTS; i++) {
+        handles[i] = slotmap_insert(map, &values[i]);
+        assert(handles[i] != SLOTMAP_NO_HANDLE);
+    }
+    assert(slotmap_size(map) == ELEMENTS);
+    assert(slotmap_get(map, SLOTMAP_NO_HANDLE) == NULL);
+    for (int i = 0; i < ELEMENTS; i++)
+        assert(slotmap_get(map, handles[i]) == &values[i]);
+    slotmap_destroy(map);
+}
+
+// a removed element's slot is reused, but its old handle must not find the new element
+static void test_stale_handle(void) {
+    slotmap_t* map = slotmap_create();
+    slotmap_handle_t old = slotmap_insert(map, &values[0]);
+    slotmap_remove(map, old);
+    assert(slotmap_get(map, old) == NULL);
+    slotmap_handle_t reused = slotmap_insert(map, &values[1]);
+    assert(reused != old);
+    assert(slotmap_get(map, old) == NULL);
+    assert(slotmap_get(map, reused) == &values[1]);
+
+    // the same slot, many generations later
+    slotmap_handle_t previous = reused;
+    for (int i = 0; i < 1000; i++) {
+        slotmap_remove(map, previous);
+        slotmap_handle_t next = slotmap_insert(map, &values[i % ELEMENTS]);
+        assert(slotmap_get(map, previous) == NULL && slotmap_get(map, old) == NULL);
+        assert(slotmap_get(map, next) == &values[i % ELEMENTS]);
+        previous = next;
+    }
+    assert(slotmap_size(map) == 1);
+    slotmap_destroy(map);
+}
+
+// removing moves the last element in the hole: handles keep working, and the elements stay contiguous
+static void test_remove_keeps_contiguous(void) {
+    slotmap_t* map = slotmap_create();
+    slotmap_handle_t handles[ELEMENTS];
+    for (int i = 0; i < ELEMENTS; i++)
+        handles[i] = slotmap_insert(map, &values[i]);
+    for (int i = 1; i < ELEMENTS; i += 2)
+        slotmap_remove(map, handles[i]);
+    assert(slotmap_size(map) == ELEMENTS / 2);
+    for (int i = 0; i < ELEMENTS; i++)
+        assert(slotmap_get(map, handles[i]) == (i % 2 == 0 ? &values[i] : NULL));
+
+    bool seen[ELEMENTS] = {false};
+    for (size_t index = 0; index < slotmap_size(map); index++) {
+        int* value = slotmap_at(map, index);
+        int i = value - values;
+        assert(i % 2 == 0 && !seen[i]);
+        seen[i] = true;
+    }
+    // the last element, and then everything
+    slotmap_remove(map, handles[ELEMENTS - 2]);
+    for (int i = 0; i < ELEMENTS - 2; i += 2)
+        slotmap_remove(map, handles[i]);
+    assert(slotmap_size(map) == 0);
+    slotmap_destroy(map);
+}
+
+int main(void) {
+    for (int i = 0; i < ELEMENTS; i++)
+        values[i] = i;
+    test_insert_get();
+    test_stale_handle();
+    test_remove_keeps_contiguous();
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * \author Mathieu Erbas
+ */
+
+#include "lib/tdigest.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stddef.h>
+
+#define VALUES 10000
+// allowed error of a quantile estimate, as a part of the range of the values
+#define TOLERANCE 0.04
+
+// the values 1 to VALUES, in a scrambled order (7919 is prime, so every value comes once)
+static double value(int i) {
+    return (double) ((i * 7919) % VALUES + 1);
+}
+
+static void assert_close(double estimate, double expected) {
+    assert(fabs(estimate - expected) <= TOLERANCE * VALUES);
+}
+
+static void test_empty(void) {
+    tdigest_t digest;
+    tdigest_init(&digest);
+    assert(digest.count == 0);
+    assert(tdigest_quantile(&digest, 0.5) == 0);
+    tdigest_t other;
+    tdigest_init(&other);
+    tdigest_merge(&digest, &other);
+    assert(digest.count == 0);
+}
+
+// with fewer values than centroids, every value keeps its own centroid
+static void test_few_values(void) {
+    tdigest_t digest;
+    tdigest_init(&digest);
+    for (int i = 5; i >= 1; i--)
+        tdigest_add(&digest, i);
+    assert(tdigest_quantile(&digest, 0) == 1);
+    assert(tdigest_quantile(&digest, 0.5) == 3);
+    assert(tdigest_quantile(&digest, 1) == 5);
+}
+
+// a uniform distribution, whose quantiles are known
+static void test_uniform(void) {
+    tdigest_t digest;
+    tdigest_init(&digest);
+    for (int i = 0; i < VALUES; i++)
+        tdigest_add(&digest, value(i));
+    assert(digest.count == VALUES && digest.size <= TDIGEST_CENTROIDS);
+    for (uint32_t i = 1; i < digest.size; i++)
+        assert(digest.mean[i - 1] <= digest.mean[i]);
+    assert(tdigest_quantile(&digest, 0) == 1);
+    assert(tdigest_quantile(&digest, 1) == VALUES);
+    assert_close(tdigest_quantile(&digest, 0.5), 0.5 * VALUES);
+    assert_close(tdigest_quantile(&digest, 0.95), 0.95 * VALUES);
+    assert_close(tdigest_quantile(&digest, 0.05), 0.05 * VALUES);
+    // out of range quantiles are clamped
+    assert(tdigest_quantile(&digest, -1) == 1 && tdigest_quantile(&digest, 2) == VALUES);
+}
+
+// squares of uniform values are skewed towards 0, so where the centroids go matters: quantile q is q² * VALUES
+static void test_skewed(void) {
+    tdigest_t digest;
+    tdigest_init(&digest);
+    for (int i = 0; i < VALUES; i++)
+        tdigest_add(&digest, value(i) * value(i) / VALUES);
+    const double quantiles[] = {0.25, 0.5, 0.75, 0.95, 0.99};
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(*quantiles); i++)
+        assert_close(tdigest_quantile(&digest, quantiles[i]), quantiles[i] * quantiles[i] * VALUES);
+}
+
+// merging the digests of two halves gives about the digest of the whole
+static void test_merge(void) {
+    tdigest_t low, high;
+    tdigest_init(&low);
+    tdigest_init(&high);
+    for (int i = 0; i < VALUES; i++) {
+        double v = value(i);
+        tdigest_add(v <= VALUES / 2 ? &low : &high, v);
+    }
+    tdigest_merge(&low, &high);
+    assert(low.count == VALUES && low.size <= TDIGEST_CENTROIDS);
+    assert(low.min == 1 && low.max == VALUES);
+    assert_close(tdigest_quantile(&low, 0.5), 0.5 * VALUES);
+    assert_close(tdigest_quantile(&low, 0.95), 0.95 * VALUES);
+}
+
+int main(void) {
+    test_empty();
+    test_few_values();
+    test_uniform();
+    test_skewed();
+    test_merge();
+    return 0;
+}
@@ -0,0 +1,121 @@
+/**
+ * \author Mathieu Erbas
+ */
+
+#include "lib/timer_wheel.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+typedef struct {
+    timer_wheel_timer_t timer;
+    time_t expiredAt; // 0 until it expired
+} entry_t;
+
+static time_t clock_now;
+
+static void on_expired(timer_wheel_timer_t* timer, void* arg) {
+    size_t* count = arg;
+    entry_t* entry = (entry_t*) ((char*) timer - offsetof(entry_t, timer));
+    assert(entry->expiredAt == 0);
+    entry->expiredAt = clock_now;
+    (*count)++;
+}
+
+// Advances 'wheel' one second at a time up to 'until', returns how many timers expired.
+static size_t advance_to(timer_wheel_t* wheel, time_t until) {
+    size_t count = 0;
+    while (clock_now < until) {
+        clock_now++;
+        size_t expired = 0;
+        assert(timer_wheel_advance(wheel, clock_now, on_expired, &expired) == expired);
+        count += expired;
+    }
+    return count;
+}
+
+static void test_expires_on_deadline(void) {
+    clock_now = 100;
+    timer_wheel_t* wheel = timer_wheel_create(5, clock_now);
+    entry_t entries[3] = {0};
+    timer_wheel_add(wheel, &entries[0].timer, 101);
+    timer_wheel_add(wheel, &entries[1].timer, 103);
+    timer_wheel_add(wheel, &entries[2].timer, 105);
+    assert(advance_to(wheel, 102) == 1);
+    assert(entries[0].expiredAt == 101 && entries[1].expiredAt == 0);
+    assert(advance_to(wheel, 105) == 2);
+    assert(entries[1].expiredAt == 103 && entries[2].expiredAt == 105);
+    assert(timer_wheel_is_empty(wheel));
+    timer_wheel_destroy(wheel);
+}
+
+// the slots are reused every span + 1 seconds, timers added all along must still expire on time
+static void test_wrap_around(void) {
+    clock_now = 7;
+    timer_wheel_t* wheel = timer_wheel_create(4, clock_now);
+    entry_t entries[40] = {0};
+    for (int i = 0; i < 40; i++) {
+        timer_wheel_add(wheel, &entries[i].timer, clock_now + 1 + i % 4);
+        advance_to(wheel, clock_now + 1);
+    }
+    advance_to(wheel, clock_now + 4);
+    for (int i = 0; i < 40; i++)
+        assert(entries[i].expiredAt == entries[i].timer.deadline);
+    assert(timer_wheel_is_empty(wheel));
+    timer_wheel_destroy(wheel);
+}
+
+// a deadline further away than the span goes around the wheel several times before it expires
+static void test_beyond_span(void) {
+    clock_now = 0;
+    timer_wheel_t* wheel = timer_wheel_create(4, clock_now);
+    entry_t entry = {0};
+    timer_wheel_add(wheel, &entry.timer, 23);
+    assert(advance_to(wheel, 22) == 0);
+    assert(!timer_wheel_is_empty(wheel));
+    assert(advance_to(wheel, 23) == 1);
+    assert(entry.expiredAt == 23);
+    timer_wheel_destroy(wheel);
+}
+
+// after a pause longer than the span, one advance expires everything that is due
+static void test_long_pause(void) {
+    clock_now = 50;
+    timer_wheel_t* wheel = timer_wheel_create(4, clock_now);
+    entry_t entries[4] = {0};
+    for (int i = 0; i < 4; i++)
+        timer_wheel_add(wheel, &entries[i].timer, clock_now + 1 + 5 * i);
+    clock_now = 1000;
+    size_t expired = 0;
+    assert(timer_wheel_advance(wheel, clock_now, on_expired, &expired) == 4 && expired == 4);
+    assert(timer_wheel_is_empty(wheel));
+    // going back in time does nothing
+    assert(timer_wheel_advance(wheel, 10, on_expired, &expired) == 0);
+    timer_wheel_destroy(wheel);
+}
+
+static void test_remove_and_past_deadline(void) {
+    clock_now = 10;
+    timer_wheel_t* wheel = timer_wheel_create(3, clock_now);
+    entry_t removed = {0}, late = {0};
+    timer_wheel_add(wheel, &removed.timer, 12);
+    timer_wheel_remove(wheel, &removed.timer);
+    timer_wheel_remove(wheel, &removed.timer); // not in the wheel anymore: nothing happens
+    assert(timer_wheel_is_empty(wheel));
+    timer_wheel_add(wheel, &late.timer, 5); // already passed: expires at the next advance
+    assert(advance_to(wheel, 14) == 1);
+    assert(removed.expiredAt == 0 && late.expiredAt == 11);
+    // an expired timer can be added again
+    timer_wheel_add(wheel, &removed.timer, 16);
+    assert(advance_to(wheel, 16) == 1 && removed.expiredAt == 16);
+    timer_wheel_destroy(wheel);
+}
+
+int main(void) {
+    test_expires_on_deadline();
+    test_wrap_around();
+    test_beyond_span();
+    test_long_pause();
+    test_remove_and_past_deadline();
+    return 0;
+}